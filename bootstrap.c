@@ -0,0 +1,78 @@
+//
+// Compiles the prelude at build time into a C file holding its bytecode, see prelude.h
+//
+// Usage: yavm_bootstrap prelude.yavm output.c
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bytecode.h"
+#include "compiler.h"
+#include "prelude.h"
+#include "vm.h"
+
+// The bootstrap tool itself starts without a prelude
+_Alignas(8) const unsigned char preludeBytecode[1] = {0};
+const size_t preludeBytecodeSize = 0;
+
+static char* readFile(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(74);
+    }
+    fseek(file, 0L, SEEK_END);
+    size_t fileSize = ftell(file);
+    rewind(file);
+
+    char* buffer = (char*)malloc(fileSize + 1);
+    if (buffer == NULL || fread(buffer, sizeof(char), fileSize, file) < fileSize) {
+        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        exit(74);
+    }
+    buffer[fileSize] = '\0';
+
+    fclose(file);
+    return buffer;
+}
+
+static bool writeSource(const char* path, const char* bytecode, size_t size) {
+    FILE* out = fopen(path, "w");
+    if (out == NULL) return false;
+    fprintf(out, "// Generated by yavm_bootstrap from the prelude, do not edit\n\n");
+    fprintf(out, "#include \"prelude.h\"\n\n");
+    fprintf(out, "_Alignas(8) const unsigned char preludeBytecode[] = {");
+    for (size_t i = 0; i < size; i++) {
+        fprintf(out, "%s0x%02x,", i % 16 == 0 ? "\n    " : " ", (unsigned char) bytecode[i]);
+    }
+    fprintf(out, "\n};\n\nconst size_t preludeBytecodeSize = %zu;\n", size);
+    return fclose(out) == 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: yavm_bootstrap prelude.yavm output.c\n");
+        exit(64);
+    }
+    VM instance;
+    initVM(&instance);
+
+    char* source = readFile(argv[1]);
+    Chunk chunk;
+    initChunk(&chunk);
+    if (!compile(source, &chunk)) exit(65);
+
+    size_t size;
+    char* bytecode = encodeBytecode(&chunk, source, &size);
+    if (bytecode == NULL || !writeSource(argv[2], bytecode, size)) {
+        fprintf(stderr, "Could not write file \"%s\".\n", argv[2]);
+        exit(74);
+    }
+
+    free(bytecode);
+    freeChunk(&chunk);
+    free(source);
+    freeVM(&instance);
+    return 0;
+}
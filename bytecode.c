@@ -0,0 +1,240 @@
+//
+// Chunks compiled ahead of time, see bytecode.h
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "compiler.h"
+#include "hash.h"
+#include "memory.h"
+#include "object.h"
+
+#define BYTECODE_MAGIC "YVMC"
+// Written as a number, so a file from a machine of the other byte order reads back differently
+#define BYTE_ORDER_MARK 0x01020304u
+
+#define SECTION_ALIGNMENT 8
+#define ALIGN_SECTION(size) (((size) + SECTION_ALIGNMENT - 1) & ~(uint64_t) (SECTION_ALIGNMENT - 1))
+
+typedef struct {
+    char magic[4];
+    uint32_t byteOrder;
+    uint32_t version;
+    uint32_t maxLocals;
+    uint64_t fingerprint;
+    // Of everything after the header
+    uint64_t checksum;
+    uint32_t codeLength;
+    uint32_t lineCount;
+    uint32_t constantCount;
+    uint32_t stringBytes;
+    uint32_t maxTemporaries;
+    uint32_t padding;
+} BytecodeHeader;
+
+typedef enum {
+    CONSTANT_NUMBER,
+    CONSTANT_STRING
+} ConstantKind;
+
+typedef struct {
+    uint32_t kind;
+    // Of a string, which is followed by a '\0' in the string section
+    uint32_t length;
+    union {
+        double number;
+        // Into the string section
+        uint64_t offset;
+    } as;
+} ConstantRecord;
+
+// Offsets of the sections from the start of the file, and the size of the whole file
+typedef struct {
+    uint64_t code;
+    uint64_t lines;
+    uint64_t constants;
+    uint64_t strings;
+    uint64_t end;
+} Layout;
+
+static Layout layoutOf(const BytecodeHeader* header) {
+    Layout layout;
+    layout.code = ALIGN_SECTION(sizeof(BytecodeHeader));
+    layout.lines = layout.code + ALIGN_SECTION((uint64_t) header->codeLength);
+    layout.constants = layout.lines + ALIGN_SECTION((uint64_t) header->lineCount * sizeof(LineStart));
+    layout.strings = layout.constants + ALIGN_SECTION((uint64_t) header->constantCount * sizeof(ConstantRecord));
+    layout.end = layout.strings + ALIGN_SECTION((uint64_t) header->stringBytes);
+    return layout;
+}
+
+static uint64_t checksumOf(const char* file, uint64_t size) {
+    return hashWyMix(file + sizeof(BytecodeHeader), (size_t) (size - sizeof(BytecodeHeader)), 0);
+}
+
+uint64_t sourceFingerprint(const char* source) {
+    return hashWyMix(source, strlen(source), 0);
+}
+
+char* encodeBytecode(Chunk* chunk, const char* source, size_t* size) {
+    BytecodeHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BYTECODE_MAGIC, sizeof(header.magic));
+    header.byteOrder = BYTE_ORDER_MARK;
+    header.version = BYTECODE_VERSION;
+    header.maxLocals = (uint32_t) chunk->maxLocals;
+    header.maxTemporaries = (uint32_t) chunk->maxTemporaries;
+    header.fingerprint = sourceFingerprint(source);
+    header.codeLength = (uint32_t) chunk->count;
+    header.lineCount = (uint32_t) chunk->lineCount;
+    header.constantCount = (uint32_t) chunk->constants.count;
+
+    uint64_t stringBytes = 0;
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        if (IS_STRING(value)) {
+            stringBytes += (uint64_t) AS_STRING(value)->length + 1;
+        } else if (!IS_NUMBER(value)) {
+            // The compiler only makes numbers and strings
+            return NULL;
+        }
+    }
+    if (stringBytes > UINT32_MAX) return NULL;
+    header.stringBytes = (uint32_t) stringBytes;
+
+    Layout layout = layoutOf(&header);
+    char* file = calloc(1, (size_t) layout.end);
+    if (file == NULL) return NULL;
+
+    memcpy(file + layout.code, chunk->code, (size_t) chunk->count);
+    if (chunk->lineCount > 0) {
+        memcpy(file + layout.lines, chunk->lines, (size_t) chunk->lineCount * sizeof(LineStart));
+    }
+    ConstantRecord* records = (ConstantRecord*) (file + layout.constants);
+    uint64_t stringOffset = 0;
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        ConstantRecord* record = &records[i];
+        if (IS_NUMBER(value)) {
+            record->kind = CONSTANT_NUMBER;
+            record->length = 0;
+            record->as.number = AS_NUMBER(value);
+        } else {
+            ObjString* string = AS_STRING(value);
+            record->kind = CONSTANT_STRING;
+            record->length = (uint32_t) string->length;
+            record->as.offset = stringOffset;
+            memcpy(file + layout.strings + stringOffset, string->chars, (size_t) string->length);
+            stringOffset += (uint64_t) string->length + 1;
+        }
+    }
+    header.checksum = checksumOf(file, layout.end);
+    memcpy(file, &header, sizeof(header));
+    *size = (size_t) layout.end;
+    return file;
+}
+
+bool writeBytecode(const char* path, Chunk* chunk, const char* source) {
+    size_t size;
+    char* file = encodeBytecode(chunk, source, &size);
+    if (file == NULL) return false;
+    bool written = replaceFile(path, file, size);
+    free(file);
+    return written;
+}
+
+static BytecodeStatus checkFile(const char* file, size_t size, const uint64_t* fingerprint) {
+    if (size < sizeof(BytecodeHeader)) return BYTECODE_INVALID;
+    const BytecodeHeader* header = (const BytecodeHeader*) file;
+    if (memcmp(header->magic, BYTECODE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->byteOrder != BYTE_ORDER_MARK) {
+        return BYTECODE_INVALID;
+    }
+    if (header->version != BYTECODE_VERSION) return BYTECODE_WRONG_VERSION;
+    if (fingerprint != NULL && header->fingerprint != *fingerprint) return BYTECODE_STALE;
+
+    if (layoutOf(header).end != size || header->codeLength > INT32_MAX || header->lineCount > INT32_MAX ||
+        header->constantCount > INT32_MAX || header->maxLocals > UINT16_COUNT ||
+        header->maxTemporaries > UINT16_COUNT) {
+        return BYTECODE_INVALID;
+    }
+    if (checksumOf(file, size) != header->checksum) return BYTECODE_INVALID;
+    return BYTECODE_OK;
+}
+
+BytecodeStatus decodeBytecode(const char* file, size_t size, Chunk* chunk, const uint64_t* fingerprint) {
+    BytecodeStatus status = checkFile(file, size, fingerprint);
+    if (status != BYTECODE_OK) return status;
+
+    const BytecodeHeader* header = (const BytecodeHeader*) file;
+    Layout layout = layoutOf(header);
+    const ConstantRecord* records = (const ConstantRecord*) (file + layout.constants);
+    const char* strings = file + layout.strings;
+    for (uint32_t i = 0; i < header->constantCount; i++) {
+        const ConstantRecord* record = &records[i];
+        if (record->kind == CONSTANT_NUMBER) continue;
+        if (record->kind != CONSTANT_STRING || record->as.offset >= header->stringBytes ||
+            record->length >= header->stringBytes - record->as.offset ||
+            strings[record->as.offset + record->length] != '\0') {
+            return BYTECODE_INVALID;
+        }
+    }
+
+    for (uint32_t i = 0; i < header->constantCount; i++) {
+        const ConstantRecord* record = &records[i];
+        if (record->kind == CONSTANT_NUMBER) {
+            addConstant(chunk, NUMBER_VAL(record->as.number));
+            continue;
+        }
+        // Names have to be interned to be found in the globals. A string that is new to the VM becomes the
+        // interned one and keeps pointing into file.
+        ObjString* string = externalString(strings + record->as.offset, (int) record->length);
+        addConstant(chunk, OBJ_VAL(internString(string)));
+    }
+
+    // The VM never writes to code, so it can stay in read-only memory
+    chunk->code = (uint8_t*) (file + layout.code);
+    chunk->count = (int) header->codeLength;
+    chunk->lines = (LineStart*) (file + layout.lines);
+    chunk->lineCount = (int) header->lineCount;
+    chunk->maxLocals = (int) header->maxLocals;
+    chunk->maxTemporaries = (int) header->maxTemporaries;
+    chunk->mapped = true;
+    return BYTECODE_OK;
+}
+
+BytecodeStatus loadBytecode(const char* path, Chunk* chunk, const uint64_t* fingerprint) {
+    MappedFile* mapping = mapFile(path);
+    if (mapping == NULL) return BYTECODE_UNREADABLE;
+
+    BytecodeStatus status = decodeBytecode(mapping->data, mapping->size, chunk, fingerprint);
+    if (status != BYTECODE_OK) unmapFile(mapping);
+    return status;
+}
+
+const char* bytecodeStatusMessage(BytecodeStatus status) {
+    switch (status) {
+        case BYTECODE_OK: return "ok";
+        case BYTECODE_UNREADABLE: return "could not be read";
+        case BYTECODE_INVALID: return "is not a bytecode file or is damaged";
+        case BYTECODE_WRONG_VERSION: return "was written by a different version";
+        case BYTECODE_STALE: return "was compiled from a different source";
+    }
+    return "unknown status";
+}
+
+bool compileCached(const char* source, Chunk* chunk, const char* directory) {
+    uint64_t fingerprint = sourceFingerprint(source);
+    char path[4096];
+    int length = snprintf(path, sizeof(path), "%s/%016llx%s", directory, (unsigned long long) fingerprint,
+                          BYTECODE_EXTENSION);
+    bool cacheable = length > 0 && (size_t) length < sizeof(path);
+    if (cacheable && loadBytecode(path, chunk, &fingerprint) == BYTECODE_OK) return true;
+
+    if (!compile(source, chunk)) return false;
+    // A cache that cannot be written only costs the next run its compile
+    if (cacheable) writeBytecode(path, chunk, source);
+    return true;
+}
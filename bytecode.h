@@ -0,0 +1,54 @@
+//
+// Chunks compiled ahead of time, stored in .yvmc files.
+//
+// A file is a header followed by four sections, each padded to 8 bytes: the code, the line table, the constants and
+// the characters of the string constants. Loading maps the file and uses the code, the line table and the string
+// characters in place, so only the constant pool itself is built on the heap. The checksum catches damaged files,
+// not crafted ones: a loaded chunk is trusted like source code.
+//
+
+#ifndef YAVM_BYTECODE_H
+#define YAVM_BYTECODE_H
+
+#include "chunk.h"
+#include "commons.h"
+#include "yavm.h"
+
+// Bumped whenever the layout or the instruction set changes, files of other versions are refused
+#define BYTECODE_VERSION 3
+#define BYTECODE_EXTENSION YAVM_BYTECODE_EXTENSION
+
+typedef enum {
+    BYTECODE_OK,
+    BYTECODE_UNREADABLE,
+    // Not a bytecode file, or damaged
+    BYTECODE_INVALID,
+    BYTECODE_WRONG_VERSION,
+    // Compiled from a different source than the one asked for
+    BYTECODE_STALE
+} BytecodeStatus;
+
+// Fingerprint of a source, stored in the header of the files compiled from it. Unlike hashBytes() it is not seeded,
+// so it is the same in every process.
+uint64_t sourceFingerprint(const char* source);
+
+// The contents of a bytecode file for chunk, which was compiled from source. Allocated with malloc(), NULL if the
+// chunk holds constants a file cannot store.
+char* encodeBytecode(Chunk* chunk, const char* source, size_t* size);
+// Writes chunk, which was compiled from source, to path with replaceFile()
+bool writeBytecode(const char* path, Chunk* chunk, const char* source);
+
+// Points chunk at the bytecode in file, which must be 8-byte aligned and outlive the chunk. Nothing is added to the
+// VM unless the whole file is valid.
+BytecodeStatus decodeBytecode(const char* file, size_t size, Chunk* chunk, const uint64_t* fingerprint);
+
+// Maps the file at path and points chunk at it, the chunk is freed as usual. With fingerprint set, the file must have
+// been compiled from a source with that fingerprint.
+BytecodeStatus loadBytecode(const char* path, Chunk* chunk, const uint64_t* fingerprint);
+const char* bytecodeStatusMessage(BytecodeStatus status);
+
+// Loads the chunk cached in directory for this source, or compiles the source and caches it there. Cached files are
+// named after the source's fingerprint, so an edited source misses the cache. False on compile errors.
+bool compileCached(const char* source, Chunk* chunk, const char* directory);
+
+#endif //YAVM_BYTECODE_H
@@ -6,13 +6,20 @@ void initChunk(Chunk* chunk) {
 	chunk->count = 0;
 	chunk->capacity = 0;
 	chunk->code = NULL;
+	chunk->lineCount = 0;
+	chunk->lineCapacity = 0;
 	chunk->lines = NULL;
 	initValueArray(&chunk->constants);
+	chunk->maxLocals = 0;
+	chunk->maxTemporaries = 0;
+	chunk->mapped = false;
 }
 
 void freeChunk(Chunk* chunk) {
-	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-	FREE_ARRAY(int, chunk->lines, chunk->capacity);
+	if (!chunk->mapped) {
+		FREE_ARRAY(uint8_t, chunk->code, chunk->capacity, MEM_CHUNK_CODE);
+		FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity, MEM_LINE_TABLE);
+	}
 	freeValueArray(&chunk->constants);
 	initChunk(chunk);
 }
@@ -22,12 +29,24 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
 		int oldCapacity = chunk->capacity;
 		chunk->capacity = GROW_CAPACITY(oldCapacity);
 		// when chunk->code is NULL (after initChuk is called), realloc is called and it behaves like malloc
-		chunk->code = GROW_ARRAY(chunk->code, uint8_t, oldCapacity, chunk->capacity);
-		chunk->lines = GROW_ARRAY(chunk->lines, uint8_t, oldCapacity, chunk->capacity);
+		chunk->code = GROW_ARRAY(chunk->code, uint8_t, oldCapacity, chunk->capacity, MEM_CHUNK_CODE);
 	}
 	chunk->code[chunk->count] = byte;
-	chunk->lines[chunk->count] = line;
 	chunk->count++;
+
+	// Still on the same line, the current run covers this byte too.
+	if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) {
+		return;
+	}
+
+	if (chunk->lineCapacity < chunk->lineCount + 1) {
+		int oldCapacity = chunk->lineCapacity;
+		chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+		chunk->lines = GROW_ARRAY(chunk->lines, LineStart, oldCapacity, chunk->lineCapacity, MEM_LINE_TABLE);
+	}
+	LineStart* lineStart = &chunk->lines[chunk->lineCount++];
+	lineStart->offset = chunk->count - 1;
+	lineStart->line = line;
 }
 
 int addConstant(Chunk* chunk, Value value)
@@ -35,3 +54,20 @@ int addConstant(Chunk* chunk, Value value)
 	writeValueArray(&chunk->constants, value);
 	return chunk->constants.count - 1;
 }
+
+int getLine(Chunk* chunk, int offset) {
+	// Binary search for the last run that starts at or before offset.
+	int start = 0;
+	int end = chunk->lineCount - 1;
+
+	while (start < end) {
+		int mid = start + (end - start + 1) / 2;
+		if (chunk->lines[mid].offset <= offset) {
+			start = mid;
+		} else {
+			end = mid - 1;
+		}
+	}
+
+	return chunk->lineCount == 0 ? 0 : chunk->lines[start].line;
+}
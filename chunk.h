@@ -4,9 +4,13 @@
 #include "commons.h"
 #include "value.h"
 
+// Constant pool indexes of the _LONG instructions are three bytes
+#define MAX_CONSTANT_INDEX 0xffffff
+
 // Operation code 
 typedef enum {
 	OP_CONSTANT,
+    OP_CONSTANT_LONG,
     OP_NIL,
     OP_TRUE,
     OP_FALSE,
@@ -25,14 +29,45 @@ typedef enum {
     OP_DEFINE_GLOBAL,
     OP_GET_GLOBAL,
     OP_SET_GLOBAL,
+    OP_DEFINE_GLOBAL_LONG,
+    OP_GET_GLOBAL_LONG,
+    OP_SET_GLOBAL_LONG,
+    // Pops a module path and binds the global to the name of the same name in that module
+    OP_IMPORT,
+    OP_IMPORT_LONG,
     OP_GET_LOCAL,
     OP_SET_LOCAL,
+    // Locals past the first 256, with a two byte slot
+    OP_GET_LOCAL_LONG,
+    OP_SET_LOCAL_LONG,
     OP_JUMP_IF_FALSE,
-    OP_JUMP
+    OP_JUMP,
+    // Adds the given number of operands left to right, strings are joined with a single allocation
+    OP_CONCAT_N,
+    // Pushes a new map with room for the given number of entries
+    OP_NEW_MAP,
+    // Stores a key and value into the map below them, leaving the map
+    OP_MAP_ENTRY,
+    OP_GET_INDEX,
+    OP_SET_INDEX,
+    OP_BUILD_ARRAY,
+    OP_FILL_ARRAY,
+    OP_LENGTH,
+    OP_SUM,
+    OP_MIN,
+    OP_MAX,
+    OP_DOT
 
 } Opcode;
 
 
+// Start of a run of bytecode that was compiled from the same source line
+typedef struct {
+	// offset of the first byte of the run
+	int offset;
+	int line;
+} LineStart;
+
 typedef struct {
 	// count of bytes allocated
 	int count;
@@ -40,17 +75,27 @@ typedef struct {
 	int capacity;
 	// bytes of code
 	uint8_t* code;
-	// line number for each byte code instruction
-	int* lines;
+	// run-length encoded line table, one entry per change of source line
+	int lineCount;
+	int lineCapacity;
+	LineStart* lines;
 
 	ValueArray constants;
 
+	// Most locals in scope at once, the VM makes room for them on its stack before running the chunk
+	int maxLocals;
+	// Most values held at once by instructions that take a run of operands, like OP_CONCAT_N, reserved the same way
+	int maxTemporaries;
+	// code and lines point into a bytecode file mapped by the VM, or the prelude, rather than into the heap
+	bool mapped;
+
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chun);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 int addConstant(Chunk* chunk, Value value);
+int getLine(Chunk* chunk, int offset);
 
 
 #endif // !chunk_h
@@ -8,8 +8,17 @@
 
 #define DEBUG_TRACE_EXECUTION
 #define DEBUG_PRINT_CODE
+// Count live bytes per category in reallocate() and print them as JSON at exit
+//#define DEBUG_MEMORY_STATS
+// Attribute allocations to bytecode sites, see profiler.h
+//#define DEBUG_HEAP_PROFILE
+// Count probe lengths and resize cost of every Table and print them for vm.strings and vm.globals at exit
+//#define DEBUG_TABLE_STATS
+// Scan the whole source into the token buffer before compiling it, instead of a window at a time as the parser reads
+//#define SCAN_WHOLE_SOURCE
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
 
 
 
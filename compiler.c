@@ -6,6 +6,18 @@
 #include <stdlib.h>
 #include "object.h"
 #include <string.h>
+#include "profiler.h"
+#include "hash.h"
+#include "intern.h"
+#include "memory.h"
+
+// The allocation statistics and the heap profile are only kept from the VM's thread, so with either of them
+// compileMany() compiles one job at a time
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(DEBUG_MEMORY_STATS) && !defined(DEBUG_HEAP_PROFILE)
+#define COMPILE_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
 #ifdef DEBUG_PRINT_CODE
 
@@ -13,13 +25,10 @@
 
 #endif
 
-typedef struct {
-    Token current;
-    Token previous;
-    bool hadError;
-    bool panicMode;
-
-} Parser;
+// Tokens scanned at a time, which keeps the token buffer in cache while the parser reads it
+#define SCAN_WINDOW_TOKENS 4096
+// A streamed segment ends with the first top-level declaration that takes it past about this many tokens
+#define STREAM_SEGMENT_TOKENS 16384
 
 typedef enum {
     PREC_NONE,
@@ -35,7 +44,7 @@ typedef enum {
     PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)(bool canAssign);  // function pointer with prototype: void ParseFn(bool canAssign)
+typedef void (*ParseFn)(Parser* parser, bool canAssign);  // function pointer with prototype: void ParseFn(Parser* parser, bool canAssign)
 
 
 typedef struct {
@@ -47,287 +56,604 @@ typedef struct {
 typedef struct {
     Token name;
     int depth;
+    uint32_t hash;
+    // The local with the same name that this one hides, or -1
+    int shadowed;
 } Local;
 
+// A name that was declared as a local, and the innermost local by that name that is still in scope, or -1. Names
+// are never removed, so a name going out of scope and coming back costs nothing.
+typedef struct {
+    const char* start;
+    int length;
+    uint32_t hash;
+    int local;
+} LocalName;
+
+// A constant already in the pool, or an empty slot when index is -1
+typedef struct {
+    Value value;
+    int index;
+} ConstantSlot;
+
 typedef struct Compiler {
-    Local locals[UINT8_COUNT];
+    Local* locals;
     int localCount;
+    int localCapacity;
     int scopeDepth;
+
+    // Open addressing with linear probing, a power of two in size
+    LocalName* names;
+    int nameCount;
+    int nameCapacity;
+
+    // Pool slots by value, so a number or string is only added to the chunk once. Open addressing like names.
+    ConstantSlot* constants;
+    int constantCount;
+    int constantCapacity;
 } Compiler;
 
-Parser parser;
+// Everything one compilation works on, so any number of them can run at once on different threads
+struct Parser {
+    TokenBuffer tokens;
+    // Indexes into tokens
+    int current;
+    int previous;
+    // Copies of their types, which are checked far more often than anything else about them
+    uint8_t currentType;
+    uint8_t previousType;
+    bool hadError;
+    bool panicMode;
+    // Sources are scanned a window at a time as the parser goes, unless SCAN_WHOLE_SOURCE scans them all up front
+    bool windowed;
+    // Tokens consumed since the current segment started
+    int advanced;
+
+    Compiler* compiler;
+    Chunk* chunk;
+    const Interner* interner;
+    // Values on the stack for instructions whose operands are still being compiled, see holdTemporaries()
+    int temporaries;
+};
 
-Compiler* current = NULL;
-Chunk *compilingChunk;
+static Chunk *currentChunk(Parser* parser) {
+    return parser->chunk;
+}
 
-static Chunk *currentChunk() {
-    return compilingChunk;
+static ObjString *internChars(Parser* parser, const char *chars, int length) {
+    return parser->interner->intern(parser->interner->state, chars, length);
 }
 
 
-static void expression();
+static void expression(Parser* parser);
 
 static ParseRule *getRule(TokenType type);
 
-static void parsePrecedence(Precedence precedence);
+static void parsePrecedence(Parser* parser, Precedence precedence);
 
 
-static void emitReturn();
-static void statement();
-static void declaration();
+static void emitReturn(Parser* parser);
+static void statement(Parser* parser);
+static void declaration(Parser* parser);
 
-static void synchronize();
+static void synchronize(Parser* parser);
 
-static uint8_t identifierConstant(Token* name);
+static int identifierConstant(Parser* parser, Token* name);
 
 
-static void ifStatement();
+static void ifStatement(Parser* parser);
 
-static void errorAt(Token *token, const char *message) {
-    if (parser.panicMode) return;
+static TokenType currentType(Parser* parser) {
+    return (TokenType) parser->currentType;
+}
+
+static TokenType previousType(Parser* parser) {
+    return (TokenType) parser->previousType;
+}
+
+static Token previousToken(Parser* parser) {
+    return tokenAt(&parser->tokens, parser->previous);
+}
 
-    parser.panicMode = true;
+static void errorAt(Parser* parser, int index, const char *message) {
+    if (parser->panicMode) return;
+    Token tokenAtIndex = tokenAt(&parser->tokens, index);
+    Token *token = &tokenAtIndex;
 
-    fprintf(stderr, "[line %d] Error", token->line);
+    parser->panicMode = true;
 
+    // One write per message, so messages from compilations on other threads cannot land in the middle of it
     if (token->type == TOKEN_EOF) {
-        fprintf(stderr, " at end");
+        fprintf(stderr, "[line %d] Error at end: %s\n", token->line, message);
     } else if (token->type == TOKEN_ERROR) {
-        // Nothing.                                                
+        fprintf(stderr, "[line %d] Error: %s\n", token->line, message);
     } else {
-        fprintf(stderr, " at '%.*s'", token->length, token->start);
+        fprintf(stderr, "[line %d] Error at '%.*s': %s\n", token->line, token->length, token->start, message);
     }
 
-    fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
+    parser->hadError = true;
 }
 
-static void error(const char *message) {
-    errorAt(&parser.previous, message);
+static void error(Parser* parser, const char *message) {
+    errorAt(parser, parser->previous, message);
 }
 
-static void errorAtCurrent(const char *message) {
-    errorAt(&parser.current, message);
+static void errorAtCurrent(Parser* parser, const char *message) {
+    errorAt(parser, parser->current, message);
 }
 
-static void advance() {
-    parser.previous = parser.current;
+static void advance(Parser* parser) {
+    parser->previous = parser->current;
+    parser->previousType = parser->currentType;
+    parser->advanced++;
 
     while (1) {
-        parser.current = scanToken();
-        if (parser.current.type != TOKEN_ERROR) break;
+        if (parser->windowed && parser->current == parser->tokens.count - 1 && !parser->tokens.complete) {
+            // Only the current token, which becomes the previous one, is still needed
+            int keep = parser->current < 0 ? 0 : 1;
+            int dropped = parser->tokens.count - keep;
+            scanTokenWindow(&parser->tokens, keep, SCAN_WINDOW_TOKENS);
+            parser->current -= dropped;
+            parser->previous -= dropped;
+        }
+        // Stays on the TOKEN_EOF at the end
+        if (parser->current < parser->tokens.count - 1) parser->current++;
+        parser->currentType = parser->tokens.types[parser->current];
+#ifdef DEBUG_HEAP_PROFILE
+        profileCompileLine(tokenLine(&parser->tokens, parser->current));
+#endif
+        if (currentType(parser) != TOKEN_ERROR) break;
 
-        errorAtCurrent(parser.current.start);
+        errorAtCurrent(parser, parser->tokens.errors[parser->tokens.lengths[parser->current]]);
     }
 }
 
-static bool check(TokenType type) {
-    return parser.current.type == type;
+static bool check(Parser* parser, TokenType type) {
+    return currentType(parser) == type;
 }
 
-static bool match(TokenType type) {
-    if (!check(type)) return false;
-    advance();
+static bool match(Parser* parser, TokenType type) {
+    if (!check(parser, type)) return false;
+    advance(parser);
     return true;
 }
-static void consume(TokenType type, const char *message) {
-    if (parser.current.type == type) {
-        advance();
+static void consume(Parser* parser, TokenType type, const char *message) {
+    if (currentType(parser) == type) {
+        advance(parser);
         return;
     }
 
-    errorAtCurrent(message);
+    errorAtCurrent(parser, message);
 }
 
-static void emitByte(uint8_t byte) {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(Parser* parser, uint8_t byte) {
+    writeChunk(currentChunk(parser), byte, tokenLine(&parser->tokens, parser->previous));
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-    emitByte(byte1);
-    emitByte(byte2);
+static void emitBytes(Parser* parser, uint8_t byte1, uint8_t byte2) {
+    emitByte(parser, byte1);
+    emitByte(parser, byte2);
 }
 
-static void endCompiler() {
+static void endCompiler(Parser* parser) {
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError) {
-        disassembleChunk(currentChunk(), "code");
+    if (!parser->hadError) {
+#ifdef COMPILE_THREADS
+        // Keeps the listing in one piece while other threads compile
+        flockfile(stdout);
+        disassembleChunk(currentChunk(parser), "code");
+        funlockfile(stdout);
+#else
+        disassembleChunk(currentChunk(parser), "code");
+#endif
     }
 #endif
-    emitReturn();
+    emitReturn(parser);
+}
+
+static void emitReturn(Parser* parser) {
+    emitByte(parser, OP_RETURN);
 }
 
-static void emitReturn() {
-    emitByte(OP_RETURN);
+// An instruction that takes a run of operands has all of them on the stack before it runs, on top of whatever the
+// expressions still being compiled push. The chunk records the most held at once so the VM can make room for them.
+static void holdTemporaries(Parser* parser, int count) {
+    parser->temporaries += count;
+    if (parser->temporaries > UINT16_MAX) {
+        error(parser, "Too many values held at once in an expression.");
+        parser->temporaries = 0;
+    }
+    if (parser->temporaries > parser->chunk->maxTemporaries) parser->chunk->maxTemporaries = parser->temporaries;
+}
+
+static void releaseTemporaries(Parser* parser, int count) {
+    parser->temporaries -= count;
+    if (parser->temporaries < 0) parser->temporaries = 0;
 }
 
-static void binary(bool canAssign) {
+static void binary(Parser* parser, bool canAssign) {
     // Remember the operator.                                
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = previousType(parser);
 
     // Compile the right operand.                            
     ParseRule *rule = getRule(operatorType);
-    parsePrecedence((Precedence) (rule->precedence + 1));
+    parsePrecedence(parser, (Precedence) (rule->precedence + 1));
+
+    if (operatorType == TOKEN_PLUS && check(parser, TOKEN_PLUS)) {
+        // a + b + c + ... adds left to right anyway, so the whole chain becomes one instruction and a string
+        // result is built with a single allocation.
+        int operands = 2;
+        holdTemporaries(parser, operands);
+        while (match(parser, TOKEN_PLUS)) {
+            if (operands == UINT8_MAX) {
+                emitBytes(parser, OP_CONCAT_N, (uint8_t) operands);
+                releaseTemporaries(parser, operands - 1);
+                operands = 1;
+            }
+            parsePrecedence(parser, (Precedence) (rule->precedence + 1));
+            operands++;
+            holdTemporaries(parser, 1);
+        }
+        emitBytes(parser, OP_CONCAT_N, (uint8_t) operands);
+        releaseTemporaries(parser, operands);
+        return;
+    }
 
     // Emit the operator instruction.                        
     switch (operatorType) {
         case TOKEN_PLUS:
-            emitByte(OP_ADD);
+            emitByte(parser, OP_ADD);
             break;
         case TOKEN_MINUS:
-            emitByte(OP_SUBTRACT);
+            emitByte(parser, OP_SUBTRACT);
             break;
         case TOKEN_STAR:
-            emitByte(OP_MULTIPLY);
+            emitByte(parser, OP_MULTIPLY);
             break;
         case TOKEN_SLASH:
-            emitByte(OP_DIVIDE);
+            emitByte(parser, OP_DIVIDE);
             break;
         case TOKEN_BANG_EQUAL:
-            emitBytes(OP_EQUAL, OP_NOT);
+            emitBytes(parser, OP_EQUAL, OP_NOT);
             break;
         case TOKEN_EQUAL_EQUAL:
-            emitByte(OP_EQUAL);
+            emitByte(parser, OP_EQUAL);
             break;
         case TOKEN_GREATER:
-            emitByte(OP_GREATER);
+            emitByte(parser, OP_GREATER);
             break;
         case TOKEN_GREATER_EQUAL:
-            emitBytes(OP_LESS, OP_NOT);
+            emitBytes(parser, OP_LESS, OP_NOT);
             break;
         case TOKEN_LESS:
-            emitByte(OP_LESS);
+            emitByte(parser, OP_LESS);
             break;
         case TOKEN_LESS_EQUAL:
-            emitBytes(OP_GREATER, OP_NOT);
+            emitBytes(parser, OP_GREATER, OP_NOT);
             break;
         default:
             return; // Unreachable.
     }
 }
 
-static void literal(bool canAssign) {
-    switch (parser.previous.type) {
+static void literal(Parser* parser, bool canAssign) {
+    switch (previousType(parser)) {
         case TOKEN_FALSE:
-            emitByte(OP_FALSE);
+            emitByte(parser, OP_FALSE);
             break;
         case TOKEN_NIL:
-            emitByte(OP_NIL);
+            emitByte(parser, OP_NIL);
             break;
         case TOKEN_TRUE:
-            emitByte(OP_TRUE);
+            emitByte(parser, OP_TRUE);
             break;
         default:
             return; // Unreachable.
     }
 }
 
-static uint8_t makeConstant(Value value) {
-    int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX) {
-        error("Too many constants in one chunk.");
-        return 0;
+// Emits op with a one byte operand, or longOp with a three byte one when the operand does not fit
+static void emitIndexed(Parser* parser, uint8_t op, uint8_t longOp, int index) {
+    if (index <= UINT8_MAX) {
+        emitBytes(parser, op, (uint8_t) index);
+        return;
+    }
+    emitBytes(parser, longOp, (index >> 16) & 0xff);
+    emitBytes(parser, (index >> 8) & 0xff, index & 0xff);
+}
+
+// Constants are numbers and interned strings, so the same bits mean the same constant
+static bool sameConstant(Value a, Value b) {
+    if (a.type != b.type) return false;
+    if (IS_NUMBER(a)) return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
+    return AS_OBJ(a) == AS_OBJ(b);
+}
+
+static uint32_t hashConstant(Value value) {
+    if (IS_STRING(value)) return stringHash(AS_STRING(value));
+
+    uint64_t bits = 0;
+    if (IS_NUMBER(value)) {
+        memcpy(&bits, &value.as.number, sizeof(double));
+    } else if (IS_OBJ(value)) {
+        bits = (uint64_t) (uintptr_t) AS_OBJ(value);
+    }
+    // The finalizer of MurmurHash3, so every bit of the double reaches the low bits used for the slot
+    bits ^= bits >> 33;
+    bits *= UINT64_C(0xff51afd7ed558ccd);
+    bits ^= bits >> 33;
+    return (uint32_t) bits;
+}
+
+static ConstantSlot* findConstant(Compiler* compiler, Value value, uint32_t hash) {
+    uint32_t mask = (uint32_t) compiler->constantCapacity - 1;
+    for (uint32_t index = hash & mask;; index = (index + 1) & mask) {
+        ConstantSlot* slot = &compiler->constants[index];
+        if (slot->index == -1 || sameConstant(slot->value, value)) return slot;
+    }
+}
+
+static void growConstants(Compiler* compiler) {
+    ConstantSlot* old = compiler->constants;
+    int oldCapacity = compiler->constantCapacity;
+    compiler->constantCapacity = oldCapacity == 0 ? 16 : oldCapacity * 2;
+    compiler->constants = ALLOCATE(ConstantSlot, compiler->constantCapacity, MEM_CONSTANTS);
+    for (int i = 0; i < compiler->constantCapacity; i++) compiler->constants[i].index = -1;
+    for (int i = 0; i < oldCapacity; i++) {
+        if (old[i].index == -1) continue;
+        *findConstant(compiler, old[i].value, hashConstant(old[i].value)) = old[i];
     }
+    FREE_ARRAY(ConstantSlot, old, oldCapacity, MEM_CONSTANTS);
+}
+
+static int makeConstant(Parser* parser, Value value) {
+    Compiler* compiler = parser->compiler;
+    if ((compiler->constantCount + 1) * 4 > compiler->constantCapacity * 3) growConstants(compiler);
+
+    ConstantSlot* slot = findConstant(compiler, value, hashConstant(value));
+    if (slot->index != -1) return slot->index;
 
-    return (uint8_t) constant;
+    int constant = addConstant(currentChunk(parser), value);
+    if (constant > MAX_CONSTANT_INDEX) {
+        error(parser, "Too many constants in one chunk.");
+        return 0;
+    }
+    slot->value = value;
+    slot->index = constant;
+    compiler->constantCount++;
+    return constant;
 }
 
-static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+static void emitConstant(Parser* parser, Value value) {
+    emitIndexed(parser, OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(parser, value));
 }
 
-static void initCompiler(Compiler* compiler) {
+static void initCompiler(Parser* parser, Compiler* compiler) {
+    compiler->locals = NULL;
     compiler->localCount = 0;
+    compiler->localCapacity = 0;
     compiler->scopeDepth = 0;
-    current = compiler;
+    compiler->names = NULL;
+    compiler->nameCount = 0;
+    compiler->nameCapacity = 0;
+    compiler->constants = NULL;
+    compiler->constantCount = 0;
+    compiler->constantCapacity = 0;
+    parser->compiler = compiler;
 }
 
-static void number(bool canAssign) {
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+static void number(Parser* parser, bool canAssign) {
+    Token token = previousToken(parser);
+    double value = numberValue(token.start, token.length);
+    emitConstant(parser, NUMBER_VAL(value));
 }
 
-static void string(bool canAssign) {
-    emitConstant(OBJ_VAL(copyString(parser.previous.start + 1,
-                                    parser.previous.length - 2)));
+static void string(Parser* parser, bool canAssign) {
+    Token token = previousToken(parser);
+    emitConstant(parser, OBJ_VAL(internChars(parser, token.start + 1, token.length - 2)));
 }
 
-static bool identifiersEqual(Token* a, Token* b) {
-    if (a->length != b->length) return false;
-    return memcmp(a->start, b->start, a->length) == 0;
+static void freeCompiler(Compiler* compiler) {
+    FREE_ARRAY(Local, compiler->locals, compiler->localCapacity, MEM_LOCALS);
+    FREE_ARRAY(LocalName, compiler->names, compiler->nameCapacity, MEM_LOCALS);
+    FREE_ARRAY(ConstantSlot, compiler->constants, compiler->constantCapacity, MEM_CONSTANTS);
 }
 
+// The slot holding name, or the empty slot where it belongs
+static LocalName* findName(Compiler* compiler, const char* start, int length, uint32_t hash) {
+    uint32_t mask = (uint32_t) compiler->nameCapacity - 1;
+    for (uint32_t index = hash & mask;; index = (index + 1) & mask) {
+        LocalName* name = &compiler->names[index];
+        if (name->start == NULL) return name;
+        if (name->hash == hash && name->length == length && memcmp(name->start, start, length) == 0) return name;
+    }
+}
 
-static int resolveLocal(Compiler* compiler, Token* name) {
-    for (int i = compiler->localCount - 1; i >= 0; i--) {
-        Local* local = &compiler->locals[i];
-        if (identifiersEqual(name, &local->name)) {
-            if (local->depth == -1) {
-                error("Cannot read local variable in its own initializer.");
-            }
-            return i;
-        }
+// Makes room for one more name
+static void reserveName(Compiler* compiler) {
+    if ((compiler->nameCount + 1) * 4 <= compiler->nameCapacity * 3) return;
+
+    LocalName* old = compiler->names;
+    int oldCapacity = compiler->nameCapacity;
+    compiler->nameCapacity = oldCapacity == 0 ? 64 : oldCapacity * 2;
+    compiler->names = ALLOCATE(LocalName, compiler->nameCapacity, MEM_LOCALS);
+    for (int i = 0; i < compiler->nameCapacity; i++) compiler->names[i].start = NULL;
+    for (int i = 0; i < oldCapacity; i++) {
+        if (old[i].start == NULL) continue;
+        *findName(compiler, old[i].start, old[i].length, old[i].hash) = old[i];
     }
+    FREE_ARRAY(LocalName, old, oldCapacity, MEM_LOCALS);
+}
+
+static int resolveLocal(Parser* parser, Compiler* compiler, Token* name) {
+    // Top-level code only ever refers to globals
+    if (compiler->localCount == 0) return -1;
 
-    return -1;
+    LocalName* entry = findName(compiler, name->start, name->length, hashBytes(name->start, (size_t) name->length));
+    if (entry->start == NULL || entry->local == -1) return -1;
+    if (compiler->locals[entry->local].depth == -1) {
+        error(parser, "Cannot read local variable in its own initializer.");
+    }
+    return entry->local;
 }
 
-static void namedVariable(Token name, bool canAssign) {
-    uint8_t getOp, setOp;
-    int arg = resolveLocal(current, &name);
-    if (arg != -1) {
-        getOp = OP_GET_LOCAL;
-        setOp = OP_SET_LOCAL;
-    } else {
-        arg = identifierConstant(&name);
-        getOp = OP_GET_GLOBAL;
-        setOp = OP_SET_GLOBAL;
+static void namedVariable(Parser* parser, Token name, bool canAssign) {
+    bool local = true;
+    int arg = resolveLocal(parser, parser->compiler, &name);
+    if (arg == -1) {
+        local = false;
+        arg = identifierConstant(parser, &name);
     }
-    if (canAssign && match(TOKEN_EQUAL)) {
-        expression();
-        emitBytes(setOp, arg);
+    bool set = false;
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        set = true;
+    }
+
+    if (!local) {
+        emitIndexed(parser, set ? OP_SET_GLOBAL : OP_GET_GLOBAL, set ? OP_SET_GLOBAL_LONG : OP_GET_GLOBAL_LONG, arg);
+    } else if (arg > UINT8_MAX) {
+        emitBytes(parser, set ? OP_SET_LOCAL_LONG : OP_GET_LOCAL_LONG, (arg >> 8) & 0xff);
+        emitByte(parser, arg & 0xff);
     } else {
-        emitBytes(getOp, arg);
+        emitBytes(parser, set ? OP_SET_LOCAL : OP_GET_LOCAL, arg);
+    }
+}
+
+// Built-in operations written as calls. There are no user functions yet, so these names are never shadowed.
+typedef struct {
+    const char* name;
+    int arity;
+    Opcode op;
+} Intrinsic;
+
+static const Intrinsic intrinsics[] = {
+        {"len", 1, OP_LENGTH},
+        {"sum", 1, OP_SUM},
+        {"min", 1, OP_MIN},
+        {"max", 1, OP_MAX},
+        {"dot", 2, OP_DOT},
+};
+
+static bool intrinsicCall(Parser* parser, Token* name) {
+    for (size_t i = 0; i < sizeof(intrinsics) / sizeof(intrinsics[0]); i++) {
+        const Intrinsic* intrinsic = &intrinsics[i];
+        if (name->length != (int) strlen(intrinsic->name) ||
+            memcmp(name->start, intrinsic->name, name->length) != 0) continue;
+
+        consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after intrinsic name.");
+        for (int arg = 0; arg < intrinsic->arity; arg++) {
+            if (arg > 0) consume(parser, TOKEN_COMMA, "Expect ',' between arguments.");
+            expression(parser);
+        }
+        consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+        emitByte(parser, intrinsic->op);
+        return true;
     }
+    return false;
 }
 
-static void variable(bool canAssign) {
-    namedVariable(parser.previous, canAssign);
+static void variable(Parser* parser, bool canAssign) {
+    Token name = previousToken(parser);
+    if (check(parser, TOKEN_LEFT_PAREN) && intrinsicCall(parser, &name)) return;
+    namedVariable(parser, name, canAssign);
 }
 
-static void expression() {
-    parsePrecedence(PREC_ASSIGNMENT);
+static void expression(Parser* parser) {
+    parsePrecedence(parser, PREC_ASSIGNMENT);
 }
 
-static void grouping(bool canAssign) {
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+static void grouping(Parser* parser, bool canAssign) {
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
 
-static void unary(bool canAssign) {
-    TokenType operatorType = parser.previous.type;
+static void unary(Parser* parser, bool canAssign) {
+    TokenType operatorType = previousType(parser);
 
     // Compile the operand.               
-    parsePrecedence(PREC_UNARY);
+    parsePrecedence(parser, PREC_UNARY);
 
     // Emit the operator instruction.              
     switch (operatorType) {
         case TOKEN_BANG:
-            emitByte(OP_NOT);
+            emitByte(parser, OP_NOT);
             break;
         case TOKEN_MINUS:
-            emitByte(OP_NEGATE);
+            emitByte(parser, OP_NEGATE);
             break;
         default:
             return; // Unreachable.
     }
 }
 
+// { key: value, ... }, the map is created with room for every entry of the literal
+static void mapLiteral(Parser* parser, bool canAssign) {
+    emitByte(parser, OP_NEW_MAP);
+    emitByte(parser, 0);
+    emitByte(parser, 0);
+    int sizeOffset = currentChunk(parser)->count - 2;
+
+    int entries = 0;
+    if (!check(parser, TOKEN_RIGHT_BRACE)) {
+        do {
+            expression(parser);
+            consume(parser, TOKEN_COLON, "Expect ':' after map key.");
+            expression(parser);
+            emitByte(parser, OP_MAP_ENTRY);
+            entries++;
+        } while (match(parser, TOKEN_COMMA));
+    }
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+
+    // Larger literals just grow past the reserved size
+    if (entries > UINT16_MAX) entries = UINT16_MAX;
+    currentChunk(parser)->code[sizeOffset] = (entries >> 8) & 0xff;
+    currentChunk(parser)->code[sizeOffset + 1] = entries & 0xff;
+}
+
+// [a, b, c] lists its elements, [value; count] repeats one value
+static void arrayLiteral(Parser* parser, bool canAssign) {
+    int elements = 0;
+    if (!check(parser, TOKEN_RIGHT_BRACKET)) {
+        expression(parser);
+        elements++;
+        if (match(parser, TOKEN_SEMICOLON)) {
+            expression(parser);
+            consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after array size.");
+            emitByte(parser, OP_FILL_ARRAY);
+            return;
+        }
+        // Every element stays on the stack until OP_BUILD_ARRAY
+        holdTemporaries(parser, 1);
+        while (match(parser, TOKEN_COMMA)) {
+            expression(parser);
+            if (elements == UINT8_MAX) error(parser, "Can't have more than 255 elements in an array literal.");
+            elements++;
+            holdTemporaries(parser, 1);
+        }
+    }
+    consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after array elements.");
+    releaseTemporaries(parser, elements);
+    emitBytes(parser, OP_BUILD_ARRAY, elements);
+}
+static void subscript(Parser* parser, bool canAssign) {
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        emitByte(parser, OP_SET_INDEX);
+    } else {
+        emitByte(parser, OP_GET_INDEX);
+    }
+}
+
 ParseRule rules[] = {
         {grouping, NULL, PREC_NONE},       // TOKEN_LEFT_PAREN
         {NULL,     NULL, PREC_NONE},       // TOKEN_RIGHT_PAREN
-        {NULL,     NULL, PREC_NONE},       // TOKEN_LEFT_BRACE
+        {mapLiteral, NULL, PREC_NONE},     // TOKEN_LEFT_BRACE
         {NULL,     NULL, PREC_NONE},       // TOKEN_RIGHT_BRACE
         {NULL,     NULL, PREC_NONE},       // TOKEN_COMMA
         {NULL,     NULL, PREC_NONE},       // TOKEN_DOT
@@ -336,6 +662,9 @@ ParseRule rules[] = {
         {NULL,     NULL, PREC_NONE},       // TOKEN_SEMICOLON
         {NULL,  binary,  PREC_FACTOR},     // TOKEN_SLASH
         {NULL,  binary,  PREC_FACTOR},     // TOKEN_STAR
+        {arrayLiteral, subscript, PREC_CALL}, // TOKEN_LEFT_BRACKET
+        {NULL,     NULL, PREC_NONE},       // TOKEN_RIGHT_BRACKET
+        {NULL,     NULL, PREC_NONE},       // TOKEN_COLON
         {unary,    NULL, PREC_NONE},       // TOKEN_BANG
         {NULL,  binary,  PREC_EQUALITY},   // TOKEN_BANG_EQUAL
         {NULL,     NULL, PREC_NONE},       // TOKEN_EQUAL
@@ -363,120 +692,125 @@ ParseRule rules[] = {
         {literal,  NULL, PREC_NONE},       // TOKEN_TRUE
         {NULL,     NULL, PREC_NONE},       // TOKEN_VAR
         {NULL,     NULL, PREC_NONE},       // TOKEN_WHILE
+        {NULL,     NULL, PREC_NONE},       // TOKEN_IMPORT
+        {NULL,     NULL, PREC_NONE},       // TOKEN_FROM
         {NULL,     NULL, PREC_NONE},       // TOKEN_ERROR
         {NULL,     NULL, PREC_NONE},       // TOKEN_EOF
 };
 
-static void parsePrecedence(Precedence precedence) {
-    advance();
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+static void parsePrecedence(Parser* parser, Precedence precedence) {
+    advance(parser);
+    ParseFn prefixRule = getRule(previousType(parser))->prefix;
     if (prefixRule == NULL) {
-        error("Expect expression.");
+        error(parser, "Expect expression.");
         return;
     }
 
     bool canAssign = precedence <= PREC_ASSIGNMENT;
-    prefixRule(canAssign);
+    prefixRule(parser, canAssign);
 
-    while (precedence <= getRule(parser.current.type)->precedence) {
-        advance();
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule(canAssign);
+    while (precedence <= getRule(currentType(parser))->precedence) {
+        advance(parser);
+        ParseFn infixRule = getRule(previousType(parser))->infix;
+        infixRule(parser, canAssign);
     }
-    if (canAssign && match(TOKEN_EQUAL)) {
-        error("Invalid assignment target.");
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        error(parser, "Invalid assignment target.");
     }
 
 }
-static void printStatement() {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-    emitByte(OP_PRINT);
+static void printStatement(Parser* parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+    emitByte(parser, OP_PRINT);
 }
 
-static void expressionStatement() {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emitByte(OP_POP);
+static void expressionStatement(Parser* parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+    emitByte(parser, OP_POP);
 }
 
-static void block() {
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-        declaration();
+static void block(Parser* parser) {
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+        declaration(parser);
     }
 
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
-static void beginScope() {
-    current->scopeDepth++;
+static void beginScope(Parser* parser) {
+    parser->compiler->scopeDepth++;
 }
-static void endScope() {
-    current->scopeDepth--;
-
-    while (current->localCount > 0 &&
-           current->locals[current->localCount - 1].depth >
-           current->scopeDepth) {
-        emitByte(OP_POP);
-        current->localCount--;
+static void endScope(Parser* parser) {
+    parser->compiler->scopeDepth--;
+
+    Compiler* compiler = parser->compiler;
+    while (compiler->localCount > 0 &&
+           compiler->locals[compiler->localCount - 1].depth >
+           compiler->scopeDepth) {
+        emitByte(parser, OP_POP);
+        // The name goes back to the local this one hid
+        Local* local = &compiler->locals[--compiler->localCount];
+        findName(compiler, local->name.start, local->name.length, local->hash)->local = local->shadowed;
     }
 }
-static void statement() {
-    if (match(TOKEN_PRINT)) {
-        printStatement();
-    }else if (match(TOKEN_LEFT_BRACE)) {
-        beginScope();
-        block();
-        endScope();
-    } else if (match(TOKEN_IF)) {
-        ifStatement();
+static void statement(Parser* parser) {
+    if (match(parser, TOKEN_PRINT)) {
+        printStatement(parser);
+    }else if (match(parser, TOKEN_LEFT_BRACE)) {
+        beginScope(parser);
+        block(parser);
+        endScope(parser);
+    } else if (match(parser, TOKEN_IF)) {
+        ifStatement(parser);
     }  else {
-        expressionStatement();
+        expressionStatement(parser);
     }
 }
-static int emitJump(uint8_t instruction) {
-    emitByte(instruction);
-    emitByte(0xff);
-    emitByte(0xff);
-    return currentChunk()->count - 2;
+static int emitJump(Parser* parser, uint8_t instruction) {
+    emitByte(parser, instruction);
+    emitByte(parser, 0xff);
+    emitByte(parser, 0xff);
+    return currentChunk(parser)->count - 2;
 }
 
-static void patchJump(int offset) {
+static void patchJump(Parser* parser, int offset) {
     // -2 to adjust for the bytecode for the jump offset itself.
-    int jump = currentChunk()->count - offset - 2;
+    int jump = currentChunk(parser)->count - offset - 2;
 
     if (jump > UINT16_MAX) {
-        error("Too much code to jump over.");
+        error(parser, "Too much code to jump over.");
     }
 
-    currentChunk()->code[offset] = (jump >> 8) & 0xff;
-    currentChunk()->code[offset + 1] = jump & 0xff;
+    currentChunk(parser)->code[offset] = (jump >> 8) & 0xff;
+    currentChunk(parser)->code[offset + 1] = jump & 0xff;
 }
 
-static void ifStatement() {
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+static void ifStatement(Parser* parser) {
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
+    int thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    statement(parser);
 
-    int elseJump = emitJump(OP_JUMP);
-    patchJump(thenJump);
-    emitByte(OP_POP);
+    int elseJump = emitJump(parser, OP_JUMP);
+    patchJump(parser, thenJump);
+    emitByte(parser, OP_POP);
 
-    if (match(TOKEN_ELSE)) statement();
-    patchJump(elseJump);
+    if (match(parser, TOKEN_ELSE)) statement(parser);
+    patchJump(parser, elseJump);
 
 }
 
-static void synchronize() {
-    parser.panicMode = false;
+static void synchronize(Parser* parser) {
+    parser->panicMode = false;
 
-    while (parser.current.type != TOKEN_EOF) {
-        if (parser.previous.type == TOKEN_SEMICOLON) return;
+    while (currentType(parser) != TOKEN_EOF) {
+        if (previousType(parser) == TOKEN_SEMICOLON) return;
 
-        switch (parser.current.type) {
+        switch (currentType(parser)) {
             case TOKEN_CLASS:
             case TOKEN_FUN:
             case TOKEN_VAR:
@@ -485,6 +819,7 @@ static void synchronize() {
             case TOKEN_WHILE:
             case TOKEN_PRINT:
             case TOKEN_RETURN:
+            case TOKEN_IMPORT:
                 return;
 
             default:
@@ -492,103 +827,362 @@ static void synchronize() {
                 ;
         }
 
-        advance();
+        advance(parser);
     }
 }
 
-static void markInitialized() {
-    current->locals[current->localCount - 1].depth =
-            current->scopeDepth;
+static void markInitialized(Parser* parser) {
+    parser->compiler->locals[parser->compiler->localCount - 1].depth =
+            parser->compiler->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
-    if (current->scopeDepth > 0) { // local variable
-        markInitialized();
+static void defineVariable(Parser* parser, int global) {
+    if (parser->compiler->scopeDepth > 0) { // local variable
+        markInitialized(parser);
         return;
     }
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitIndexed(parser, OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
 }
-static void addLocal(Token name) {
-    if (current->localCount == UINT8_COUNT) {
-        error("Too many local variables in function.");
+static void addLocal(Parser* parser, Token name, uint32_t hash, LocalName* entry) {
+    Compiler* compiler = parser->compiler;
+    if (compiler->localCount == UINT16_COUNT) {
+        error(parser, "Too many local variables in function.");
         return;
     }
-    Local* local = &current->locals[current->localCount++];
+    if (compiler->localCount == compiler->localCapacity) {
+        int oldCapacity = compiler->localCapacity;
+        compiler->localCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->locals = GROW_ARRAY(compiler->locals, Local, oldCapacity, compiler->localCapacity, MEM_LOCALS);
+    }
+    if (entry->start == NULL) {
+        entry->start = name.start;
+        entry->length = name.length;
+        entry->hash = hash;
+        entry->local = -1;
+        compiler->nameCount++;
+    }
+
+    Local* local = &compiler->locals[compiler->localCount];
     local->name = name;
     local->depth = -1;
+    local->hash = hash;
+    local->shadowed = entry->local;
+    entry->local = compiler->localCount++;
+    if (compiler->localCount > parser->chunk->maxLocals) parser->chunk->maxLocals = compiler->localCount;
 }
 
 
 // Declares local variables
-static void declareVariable() {
+static void declareVariable(Parser* parser) {
+    Compiler* compiler = parser->compiler;
     // Global variables are implicitly declared.
-    if (current->scopeDepth == 0) return;
-    for (int i = current->localCount - 1; i >= 0; i--) {
-        Local* local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scopeDepth) {
-            break;
-        }
-
-        if (identifiersEqual(name, &local->name)) {
-            error("Variable with this name already declared in this scope.");
+    if (compiler->scopeDepth == 0) return;
+    Token name = previousToken(parser);
+    uint32_t hash = hashBytes(name.start, (size_t) name.length);
+
+    reserveName(compiler);
+    LocalName* entry = findName(compiler, name.start, name.length, hash);
+    // Locals of deeper scopes are gone by now, so a local by this name is either in this scope or an outer one
+    if (entry->start != NULL && entry->local != -1) {
+        Local* innermost = &compiler->locals[entry->local];
+        if (innermost->depth == -1 || innermost->depth == compiler->scopeDepth) {
+            error(parser, "Variable with this name already declared in this scope.");
         }
     }
-    Token* name = &parser.previous;
-    addLocal(*name);
+    addLocal(parser, name, hash, entry);
 }
 
 // parses the variable name, add it to the constant pool, and return its id in the constant array chunk->constants
-static uint8_t parseVariable(const char* errorMessage) {
-    consume(TOKEN_IDENTIFIER, errorMessage);
+static int parseVariable(Parser* parser, const char* errorMessage) {
+    consume(parser, TOKEN_IDENTIFIER, errorMessage);
 
-    declareVariable();
-    if (current->scopeDepth > 0) return 0; // local variable
-    return identifierConstant(&parser.previous);
+    declareVariable(parser);
+    if (parser->compiler->scopeDepth > 0) return 0; // local variable
+    Token name = previousToken(parser);
+    return identifierConstant(parser, &name);
 }
 
-static void varDeclaration() {
-    uint8_t global = parseVariable("Expect variable name.");
+static void varDeclaration(Parser* parser) {
+    int global = parseVariable(parser, "Expect variable name.");
 
-    if (match(TOKEN_EQUAL)) {
-        expression();
+    if (match(parser, TOKEN_EQUAL)) {
+        expression(parser);
     } else {
-        emitByte(OP_NIL);
+        emitByte(parser, OP_NIL);
     }
-    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+
+    defineVariable(parser, global);
+}
+
+// import a, b from "path"; binds each name to the global of the same name in the module. The module only loads when
+// one of them is first read.
+static void importDeclaration(Parser* parser) {
+    if (parser->compiler->scopeDepth > 0) error(parser, "Imports must be at the top level.");
+
+    int names[UINT8_COUNT];
+    int nameCount = 0;
+    do {
+        consume(parser, TOKEN_IDENTIFIER, "Expect name to import.");
+        Token name = previousToken(parser);
+        if (nameCount == UINT8_COUNT) {
+            error(parser, "Too many names in one import.");
+        } else {
+            names[nameCount++] = identifierConstant(parser, &name);
+        }
+    } while (match(parser, TOKEN_COMMA));
 
-    defineVariable(global);
+    consume(parser, TOKEN_FROM, "Expect 'from' after imported names.");
+    consume(parser, TOKEN_STRING, "Expect module path.");
+    Token path = previousToken(parser);
+    int pathConstant = makeConstant(parser, OBJ_VAL(internChars(parser, path.start + 1, path.length - 2)));
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after import.");
+
+    for (int i = 0; i < nameCount; i++) {
+        emitIndexed(parser, OP_CONSTANT, OP_CONSTANT_LONG, pathConstant);
+        emitIndexed(parser, OP_IMPORT, OP_IMPORT_LONG, names[i]);
+    }
 }
 
-static void declaration() {
-    if (match(TOKEN_VAR)) {
-        varDeclaration();
+static void declaration(Parser* parser) {
+    if (match(parser, TOKEN_VAR)) {
+        varDeclaration(parser);
+    } else if (match(parser, TOKEN_IMPORT)) {
+        importDeclaration(parser);
     } else {
-        statement();
+        statement(parser);
     }
-    if (parser.panicMode) synchronize();
+    if (parser->panicMode) synchronize(parser);
 }
 
 static ParseRule *getRule(TokenType type) {
     return &rules[type];
 }
 
-uint8_t identifierConstant(Token *name) {
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+int identifierConstant(Parser* parser, Token *name) {
+    return makeConstant(parser, OBJ_VAL(internChars(parser, name->start, name->length)));
+}
+
+static void startParser(Parser* parser, const char *source, bool windowed) {
+    initTokenBuffer(&parser->tokens);
+    parser->windowed = windowed;
+    if (windowed) {
+        startTokens(&parser->tokens, source);
+    } else {
+        scanTokens(&parser->tokens, source);
+    }
+    // The first advance() moves onto token 0
+    parser->current = -1;
+    parser->previous = -1;
+    parser->currentType = TOKEN_EOF;
+    parser->hadError = false;
+    parser->panicMode = false;
+    parser->temporaries = 0;
+    advance(parser);
+}
+
+// Token offsets are 32 bits
+static bool checkSourceSize(const char *source) {
+    if (strlen(source) > UINT32_MAX) {
+        fprintf(stderr, "Source is too large to compile.\n");
+        return false;
+    }
+    return true;
+}
+
+static ObjString *internInVM(void *state, const char *chars, int length) {
+    (void) state;
+    return copyString(chars, length);
+}
+
+const Interner vmInterner = {internInVM, NULL};
+
+bool compileWith(const char *source, Chunk *chunk, const Interner *interner) {
+    if (!checkSourceSize(source)) return false;
+    Parser parser;
+    parser.interner = interner;
+#ifdef SCAN_WHOLE_SOURCE
+    startParser(&parser, source, false);
+#else
+    startParser(&parser, source, true);
+#endif
+    Compiler compiler;
+    initCompiler(&parser, &compiler);
+    parser.chunk = chunk;
+
+    while (!match(&parser, TOKEN_EOF)) {
+        declaration(&parser);
+    }
+    endCompiler(&parser);
+    freeCompiler(&compiler);
+    freeTokenBuffer(&parser.tokens);
+    return !parser.hadError;
 }
 
 bool compile(const char *source, Chunk *chunk) {
-    initScanner(source);
+    return compileWith(source, chunk, &vmInterner);
+}
+
+Parser *startStream(const char *source) {
+    if (!checkSourceSize(source)) return NULL;
+    // Counted with the tokens, which are most of what a stream holds on to
+    Parser *stream = ALLOCATE(Parser, 1, MEM_TOKENS);
+    stream->interner = &vmInterner;
+    startParser(stream, source, true);
+    return stream;
+}
+
+bool compileSegment(Parser *stream, Chunk *chunk, bool *done) {
     Compiler compiler;
-    initCompiler(&compiler);
-    compilingChunk = chunk;
+    initCompiler(stream, &compiler);
+    stream->chunk = chunk;
 
-    parser.hadError = false;
-    parser.panicMode = false;
+    // Top-level declarations leave no locals behind, so the segment can end after any of them
+    stream->advanced = 0;
+    while (stream->advanced < STREAM_SEGMENT_TOKENS && !check(stream, TOKEN_EOF)) {
+        declaration(stream);
+    }
+    *done = match(stream, TOKEN_EOF);
+    endCompiler(stream);
+    freeCompiler(&compiler);
+    return !stream->hadError;
+}
+
+size_t streamPosition(Parser *stream) {
+    return stream->tokens.offsets[stream->current];
+}
+
+void endStream(Parser *stream) {
+    freeTokenBuffer(&stream->tokens);
+    FREE(Parser, stream, MEM_TOKENS);
+}
+
+#ifdef COMPILE_THREADS
+#define MAX_COMPILE_THREADS 64
+
+// Strings made by a worker thread, which cannot touch the VM's string table. They are interned among themselves and
+// swapped for the VM's own strings once every worker is done.
+typedef struct {
+    Table table;
+    // Linked through obj.next
+    ObjString *first;
+} LocalStrings;
+
+static ObjString *internLocally(void *state, const char *chars, int length) {
+    LocalStrings *strings = (LocalStrings *) state;
+    uint32_t hash = hashBytes(chars, (size_t) length);
+    ObjString *string = tableFindString(&strings->table, chars, length, hash);
+    if (string != NULL) return string;
+
+    string = detachedString(chars, length, hash);
+    string->obj.next = (Obj *) strings->first;
+    strings->first = string;
+    tableSet(&strings->table, string, NIL_VAL);
+    return string;
+}
 
-    advance();
-    while (!match(TOKEN_EOF)) {
-        declaration();
+static void freeLocalStrings(LocalStrings *strings) {
+    freeTable(&strings->table);
+    ObjString *string = strings->first;
+    while (string != NULL) {
+        ObjString *next = (ObjString *) string->obj.next;
+        freeDetachedString(string);
+        string = next;
     }
-    endCompiler();
-    return !parser.hadError;
-}
\ No newline at end of file
+}
+
+
+typedef struct {
+    CompileJob *jobs;
+    int count;
+    atomic_int next;
+    // With shared interning every thread can intern straight into the shared table
+    bool shared;
+} CompileQueue;
+
+typedef struct {
+    CompileQueue *queue;
+    LocalStrings strings;
+    size_t allocated;
+} CompileWorker;
+
+static void *runCompileWorker(void *argument) {
+    CompileWorker *worker = (CompileWorker *) argument;
+    CompileQueue *queue = worker->queue;
+    Interner local = {internLocally, &worker->strings};
+    const Interner *interner = queue->shared ? &vmInterner : &local;
+
+    allocationSink = &worker->allocated;
+    for (;;) {
+        int index = atomic_fetch_add_explicit(&queue->next, 1, memory_order_relaxed);
+        if (index >= queue->count) break;
+        CompileJob *job = &queue->jobs[index];
+        job->compiled = compileWith(job->source, &job->chunk, interner);
+    }
+    allocationSink = NULL;
+    return NULL;
+}
+
+static int onlineCores() {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores < 1 ? 1 : cores > MAX_COMPILE_THREADS ? MAX_COMPILE_THREADS : (int) cores;
+}
+#endif
+
+static void compileSerially(CompileJob *jobs, int count) {
+    for (int i = 0; i < count; i++) {
+        jobs[i].compiled = compileWith(jobs[i].source, &jobs[i].chunk, &vmInterner);
+    }
+}
+
+void compileMany(CompileJob *jobs, int count, int threads) {
+#ifndef COMPILE_THREADS
+    compileSerially(jobs, count);
+#else
+    if (threads <= 0) threads = onlineCores();
+    if (threads > MAX_COMPILE_THREADS) threads = MAX_COMPILE_THREADS;
+    if (threads > count) threads = count;
+    if (threads <= 1) {
+        compileSerially(jobs, count);
+        return;
+    }
+
+    CompileQueue queue;
+    queue.jobs = jobs;
+    queue.count = count;
+    atomic_init(&queue.next, 0);
+    queue.shared = sharedInterningEnabled();
+
+    CompileWorker workers[MAX_COMPILE_THREADS];
+    pthread_t handles[MAX_COMPILE_THREADS];
+    bool started[MAX_COMPILE_THREADS];
+    for (int i = 0; i < threads; i++) {
+        workers[i].queue = &queue;
+        initTable(&workers[i].strings.table);
+        workers[i].strings.first = NULL;
+        workers[i].allocated = 0;
+    }
+    // This thread is the first worker. A thread that fails to start just leaves its share to the others.
+    for (int i = 1; i < threads; i++) {
+        started[i] = pthread_create(&handles[i], NULL, runCompileWorker, &workers[i]) == 0;
+    }
+    runCompileWorker(&workers[0]);
+    for (int i = 1; i < threads; i++) {
+        if (started[i]) pthread_join(handles[i], NULL);
+    }
+
+    for (int i = 0; i < threads; i++) chargeAllocations(workers[i].allocated);
+    if (!queue.shared) {
+        // Every string constant came from a worker's local strings
+        for (int i = 0; i < count; i++) {
+            ValueArray *constants = &jobs[i].chunk.constants;
+            for (int constant = 0; constant < constants->count; constant++) {
+                if (!IS_STRING(constants->values[constant])) continue;
+                ObjString *string = AS_STRING(constants->values[constant]);
+                constants->values[constant] = OBJ_VAL(copyString(string->chars, string->length));
+            }
+        }
+    }
+    for (int i = 0; i < threads; i++) freeLocalStrings(&workers[i].strings);
+#endif
+}
@@ -2,7 +2,39 @@
 #define compiler_h          
 #include "vm.h"                                
 
+// Turns identifiers and string literals into the strings kept in the constant pool. It is called on the thread that
+// compiles.
+typedef struct {
+    ObjString* (*intern)(void* state, const char* chars, int length);
+    void* state;
+} Interner;
+
+// Interns into the VM's strings, so only the VM's thread may compile with it
+extern const Interner vmInterner;
 
 bool compile(const char* source, Chunk* chunk);
+bool compileWith(const char* source, Chunk* chunk, const Interner* interner);
+
+typedef struct {
+    const char* source;
+    // Must be initialized before compileMany()
+    Chunk chunk;
+    // Set when the source compiled without errors
+    bool compiled;
+} CompileJob;
+
+// Compiles every job on up to threads threads, or one per core when threads is 0. Call it from the VM's thread.
+// Strings are interned into the shared table if it is enabled, and otherwise into the VM once all jobs are done.
+void compileMany(CompileJob* jobs, int count, int threads);
+
+typedef struct Parser Parser;
+
+// Compiles source a batch of top-level declarations at a time, so each batch can run and be freed before the next is
+// compiled. compileSegment() sets done after the last one. startStream() returns NULL if the source is too large.
+Parser* startStream(const char* source);
+bool compileSegment(Parser* stream, Chunk* chunk, bool* done);
+// Offset in the source of the first token not compiled yet
+size_t streamPosition(Parser* stream);
+void endStream(Parser* stream);
 
-#endif     
\ No newline at end of file
+#endif     
@@ -13,6 +13,14 @@ static int constantInstruction(const char *name, Chunk *chunk,
     return offset + 2;
 }
 
+static int constantLongInstruction(const char *name, Chunk *chunk, int offset) {
+    int constant = (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4;
+}
+
 static int simpleInstruction(const char *name, int offset) {
     printf("%s\n", name);
     return offset + 1;
@@ -31,6 +39,12 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset) {
     printf("%-16s %4d\n", name, slot);
     return offset + 2;
 }
+static int shortInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t operand = (uint16_t)(chunk->code[offset + 1] << 8);
+    operand |= chunk->code[offset + 2];
+    printf("%-16s %4d\n", name, operand);
+    return offset + 3;
+}
 static int jumpInstruction(const char* name, int sign, Chunk* chunk,
                            int offset) {
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
@@ -38,18 +52,70 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk,
     printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
     return offset + 3;
 }
+const char *opcodeName(uint8_t instruction) {
+    switch (instruction) {
+        case OP_CONSTANT: return "OP_CONSTANT";
+        case OP_CONSTANT_LONG: return "OP_CONSTANT_LONG";
+        case OP_NIL: return "OP_NIL";
+        case OP_TRUE: return "OP_TRUE";
+        case OP_FALSE: return "OP_FALSE";
+        case OP_NEGATE: return "OP_NEGATE";
+        case OP_ADD: return "OP_ADD";
+        case OP_SUBTRACT: return "OP_SUBTRACT";
+        case OP_MULTIPLY: return "OP_MULTIPLY";
+        case OP_DIVIDE: return "OP_DIVIDE";
+        case OP_NOT: return "OP_NOT";
+        case OP_EQUAL: return "OP_EQUAL";
+        case OP_GREATER: return "OP_GREATER";
+        case OP_LESS: return "OP_LESS";
+        case OP_PRINT: return "OP_PRINT";
+        case OP_POP: return "OP_POP";
+        case OP_RETURN: return "OP_RETURN";
+        case OP_DEFINE_GLOBAL: return "OP_DEFINE_GLOBAL";
+        case OP_GET_GLOBAL: return "OP_GET_GLOBAL";
+        case OP_SET_GLOBAL: return "OP_SET_GLOBAL";
+        case OP_DEFINE_GLOBAL_LONG: return "OP_DEFINE_GLOBAL_LONG";
+        case OP_GET_GLOBAL_LONG: return "OP_GET_GLOBAL_LONG";
+        case OP_SET_GLOBAL_LONG: return "OP_SET_GLOBAL_LONG";
+        case OP_IMPORT: return "OP_IMPORT";
+        case OP_IMPORT_LONG: return "OP_IMPORT_LONG";
+        case OP_GET_LOCAL: return "OP_GET_LOCAL";
+        case OP_SET_LOCAL: return "OP_SET_LOCAL";
+        case OP_GET_LOCAL_LONG: return "OP_GET_LOCAL_LONG";
+        case OP_SET_LOCAL_LONG: return "OP_SET_LOCAL_LONG";
+        case OP_JUMP_IF_FALSE: return "OP_JUMP_IF_FALSE";
+        case OP_JUMP: return "OP_JUMP";
+        case OP_CONCAT_N: return "OP_CONCAT_N";
+        case OP_NEW_MAP: return "OP_NEW_MAP";
+        case OP_MAP_ENTRY: return "OP_MAP_ENTRY";
+        case OP_GET_INDEX: return "OP_GET_INDEX";
+        case OP_SET_INDEX: return "OP_SET_INDEX";
+        case OP_BUILD_ARRAY: return "OP_BUILD_ARRAY";
+        case OP_FILL_ARRAY: return "OP_FILL_ARRAY";
+        case OP_LENGTH: return "OP_LENGTH";
+        case OP_SUM: return "OP_SUM";
+        case OP_MIN: return "OP_MIN";
+        case OP_MAX: return "OP_MAX";
+        case OP_DOT: return "OP_DOT";
+        default: return "OP_UNKNOWN";
+    }
+}
+
 int disassembleInstruction(Chunk *chunk, int offset) {
     printf("%04d ", offset);
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1)) {
         printf("   | ");
     } else {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
     }
 
     uint8_t instruction = chunk->code[offset];
     switch (instruction) {
         case OP_CONSTANT:
             return constantInstruction("OP_CONSTANT", chunk, offset);
+        case OP_CONSTANT_LONG:
+            return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
         case OP_NEGATE:
             return simpleInstruction("OP_NEGATE", offset);
         case OP_ADD:
@@ -89,15 +155,53 @@ int disassembleInstruction(Chunk *chunk, int offset) {
             return constantInstruction("OP_GET_GLOBAL", chunk, offset);
         case OP_SET_GLOBAL:
             return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+        case OP_DEFINE_GLOBAL_LONG:
+            return constantLongInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
+        case OP_GET_GLOBAL_LONG:
+            return constantLongInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
+        case OP_SET_GLOBAL_LONG:
+            return constantLongInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
+        case OP_IMPORT:
+            return constantInstruction("OP_IMPORT", chunk, offset);
+        case OP_IMPORT_LONG:
+            return constantLongInstruction("OP_IMPORT_LONG", chunk, offset);
         case OP_GET_LOCAL:
             return byteInstruction("OP_GET_LOCAL", chunk, offset);
         case OP_SET_LOCAL:
             return byteInstruction("OP_SET_LOCAL", chunk, offset);
+        case OP_GET_LOCAL_LONG:
+            return shortInstruction("OP_GET_LOCAL_LONG", chunk, offset);
+        case OP_SET_LOCAL_LONG:
+            return shortInstruction("OP_SET_LOCAL_LONG", chunk, offset);
 
         case OP_JUMP:
             return jumpInstruction("OP_JUMP", 1, chunk, offset);
         case OP_JUMP_IF_FALSE:
             return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_CONCAT_N:
+            return byteInstruction("OP_CONCAT_N", chunk, offset);
+        case OP_NEW_MAP:
+            return shortInstruction("OP_NEW_MAP", chunk, offset);
+        case OP_MAP_ENTRY:
+            return simpleInstruction("OP_MAP_ENTRY", offset);
+        case OP_GET_INDEX:
+            return simpleInstruction("OP_GET_INDEX", offset);
+        case OP_SET_INDEX:
+            return simpleInstruction("OP_SET_INDEX", offset);
+        case OP_BUILD_ARRAY:
+            return byteInstruction("OP_BUILD_ARRAY", chunk, offset);
+        case OP_FILL_ARRAY:
+            return simpleInstruction("OP_FILL_ARRAY", offset);
+        case OP_LENGTH:
+            return simpleInstruction("OP_LENGTH", offset);
+        case OP_SUM:
+            return simpleInstruction("OP_SUM", offset);
+        case OP_MIN:
+            return simpleInstruction("OP_MIN", offset);
+        case OP_MAX:
+            return simpleInstruction("OP_MAX", offset);
+        case OP_DOT:
+            return simpleInstruction("OP_DOT", offset);
 
     }
 }
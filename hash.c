@@ -0,0 +1,154 @@
+//
+// String hashing and key comparison shared by interning and Table.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __linux__
+#include <sys/random.h>
+#endif
+
+static HashFunction hashFunction = hashWyMix;
+static uint64_t hashSeed = 0;
+static bool seeded = false;
+
+static const uint64_t secret[4] = {
+        0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+};
+
+// 64x64 -> 128 bit multiply, folded back to 64 bits
+static uint64_t mix(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t product = (__uint128_t) a * b;
+    return (uint64_t) product ^ (uint64_t) (product >> 64);
+#else
+    uint64_t aHigh = a >> 32, aLow = (uint32_t) a, bHigh = b >> 32, bLow = (uint32_t) b;
+    uint64_t high = aHigh * bHigh, middle0 = aHigh * bLow, middle1 = aLow * bHigh, low = aLow * bLow;
+    uint64_t carry = ((low >> 32) + (uint32_t) middle0 + (uint32_t) middle1) >> 32;
+    uint64_t productLow = low + (middle0 << 32) + (middle1 << 32);
+    uint64_t productHigh = high + (middle0 >> 32) + (middle1 >> 32) + carry;
+    return productLow ^ productHigh;
+#endif
+}
+
+static uint64_t read64(const uint8_t *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint64_t read32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+uint64_t hashWyMix(const void *key, size_t length, uint64_t seed) {
+    const uint8_t *p = key;
+    uint64_t a, b;
+    seed ^= mix(seed ^ secret[0], secret[1]);
+
+    if (length <= 16) {
+        if (length >= 4) {
+            // Two overlapping reads from each end cover every byte
+            size_t middle = (length >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + middle);
+            b = (read32(p + length - 4) << 32) | read32(p + length - 4 - middle);
+        } else if (length > 0) {
+            a = ((uint64_t) p[0] << 16) | ((uint64_t) p[length >> 1] << 8) | p[length - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t left = length;
+        if (left > 48) {
+            // Three independent lanes keep the multipliers busy on long keys
+            uint64_t seed1 = seed, seed2 = seed;
+            do {
+                seed = mix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+                seed1 = mix(read64(p + 16) ^ secret[2], read64(p + 24) ^ seed1);
+                seed2 = mix(read64(p + 32) ^ secret[3], read64(p + 40) ^ seed2);
+                p += 48;
+                left -= 48;
+            } while (left > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (left > 16) {
+            seed = mix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+            p += 16;
+            left -= 16;
+        }
+        a = read64(p + left - 16);
+        b = read64(p + left - 8);
+    }
+
+    return mix(secret[1] ^ length, mix(a ^ secret[1], b ^ seed));
+}
+
+// FNV-1a hash function, with the seed folded into the offset basis
+uint64_t hashFnv1a(const void *key, size_t length, uint64_t seed) {
+    const uint8_t *bytes = key;
+    uint32_t hash = 2166136261u ^ (uint32_t) (seed ^ (seed >> 32));
+
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619;
+    }
+
+    return hash;
+}
+
+void initHash() {
+    if (seeded) return;
+    seeded = true;
+
+    const char *fixed = getenv("YAVM_HASH_SEED");
+    if (fixed != NULL) {
+        hashSeed = strtoull(fixed, NULL, 0);
+        return;
+    }
+#ifdef __linux__
+    if (getrandom(&hashSeed, sizeof(hashSeed), GRND_NONBLOCK) == sizeof(hashSeed)) return;
+#endif
+    // Without a random source mix in what differs between processes
+    hashSeed = mix((uint64_t) time(NULL) ^ secret[2], (uint64_t) (uintptr_t) &hashSeed ^ (uint64_t) clock());
+}
+
+void setHashFunction(HashFunction function) {
+    hashFunction = function;
+}
+
+uint32_t hashBytes(const char *key, size_t length) {
+    return (uint32_t) hashFunction(key, length, hashSeed);
+}
+
+bool bytesEqual(const char *a, const char *b, size_t length) {
+#ifdef __SSE2__
+    if (length >= 16) {
+        // 16 bytes per compare, the last block overlaps the previous one instead of handling a tail
+        size_t last = length - 16;
+        for (size_t i = 0; i < last; i += 16) {
+            __m128i left = _mm_loadu_si128((const __m128i *) (a + i));
+            __m128i right = _mm_loadu_si128((const __m128i *) (b + i));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(left, right)) != 0xffff) return false;
+        }
+        __m128i left = _mm_loadu_si128((const __m128i *) (a + last));
+        __m128i right = _mm_loadu_si128((const __m128i *) (b + last));
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(left, right)) == 0xffff;
+    }
+#endif
+    if (length >= 8) {
+        return read64((const uint8_t *) a) == read64((const uint8_t *) b) &&
+               read64((const uint8_t *) a + length - 8) == read64((const uint8_t *) b + length - 8);
+    }
+    return memcmp(a, b, length) == 0;
+}
@@ -0,0 +1,27 @@
+//
+// String hashing and key comparison shared by interning and Table.
+//
+
+#ifndef YAVM_HASH_H
+#define YAVM_HASH_H
+
+#include "commons.h"
+
+typedef uint64_t (*HashFunction)(const void* key, size_t length, uint64_t seed);
+
+// Word-at-a-time multiply-mix hash in the style of wyhash, the default
+uint64_t hashWyMix(const void* key, size_t length, uint64_t seed);
+// The original byte-at-a-time FNV-1a, seeded through its offset basis
+uint64_t hashFnv1a(const void* key, size_t length, uint64_t seed);
+
+// Picks the process seed, from YAVM_HASH_SEED when set so runs can be reproduced. Safe to call more than once.
+void initHash();
+// Only valid before any string has been hashed
+void setHashFunction(HashFunction function);
+
+// Seeded hash used for interning and table keys
+uint32_t hashBytes(const char* key, size_t length);
+
+bool bytesEqual(const char* a, const char* b, size_t length);
+
+#endif //YAVM_HASH_H
@@ -0,0 +1,194 @@
+//
+// Optional process-wide string intern table, shared by every VM and thread.
+//
+// Slots are claimed with a compare-and-swap and never change once they hold a string, so lookups need no locks.
+// Growing installs a bigger table as the successor of the full one, then freezes every empty slot of the full
+// table and copies its strings over. A probe that reaches a frozen slot continues in the successor. A key's
+// first free slot is decided by a single compare-and-swap, either to the key or to frozen, so no string can end up
+// interned twice.
+//
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "intern.h"
+#include "object.h"
+
+#define INTERN_INITIAL_CAPACITY 1024
+
+typedef struct InternTable {
+    size_t capacity;
+    atomic_size_t count;
+    _Atomic(struct InternTable *) next;
+    _Atomic(ObjString *) slots[];
+} InternTable;
+
+// Marks a slot that was empty when its table started growing
+static ObjString frozen;
+#define FROZEN (&frozen)
+
+static atomic_bool enabled = false;
+// The oldest table, which links to all the others, and the newest one that finished growing
+static _Atomic(InternTable *) first = NULL;
+static _Atomic(InternTable *) root = NULL;
+// Every published string, linked through obj.next
+static _Atomic(ObjString *) allStrings = NULL;
+
+static InternTable *newTable(size_t capacity) {
+    InternTable *table = malloc(sizeof(InternTable) + sizeof(_Atomic(ObjString *)) * capacity);
+    if (table == NULL) {
+        fprintf(stderr, "Out of memory for the shared intern table.\n");
+        exit(74);
+    }
+    table->capacity = capacity;
+    atomic_init(&table->count, 0);
+    atomic_init(&table->next, NULL);
+    for (size_t i = 0; i < capacity; i++) atomic_init(&table->slots[i], NULL);
+    return table;
+}
+
+void enableSharedInterning() {
+    InternTable *expected = NULL;
+    InternTable *table = newTable(INTERN_INITIAL_CAPACITY);
+    if (atomic_compare_exchange_strong(&first, &expected, table)) {
+        atomic_store(&root, table);
+    } else {
+        free(table);
+    }
+    atomic_store(&enabled, true);
+}
+
+bool sharedInterningEnabled() {
+    return atomic_load_explicit(&enabled, memory_order_relaxed);
+}
+
+static bool matches(ObjString *string, const char *chars, int length, uint32_t hash) {
+    return string->hash == hash && string->length == length && bytesEqual(string->chars, chars, (size_t) length);
+}
+
+static InternTable *successor(InternTable *table);
+
+// Returns the string with the same contents as candidate, placing candidate if there is none. With a NULL
+// candidate it only looks.
+static ObjString *findOrInsert(InternTable *table, const char *chars, int length, uint32_t hash,
+                               ObjString *candidate);
+
+static void grow(InternTable *table) {
+    InternTable *expected = NULL;
+    InternTable *bigger = newTable(table->capacity * 2);
+    if (!atomic_compare_exchange_strong(&table->next, &expected, bigger)) {
+        // Another thread is already growing it
+        free(bigger);
+        return;
+    }
+
+    for (size_t i = 0; i < table->capacity; i++) {
+        ObjString *string = NULL;
+        if (atomic_compare_exchange_strong(&table->slots[i], &string, FROZEN)) continue;
+        findOrInsert(bigger, string->chars, string->length, string->hash, string);
+    }
+
+    InternTable *current = atomic_load(&root);
+    while (current->capacity < bigger->capacity &&
+           !atomic_compare_exchange_weak(&root, &current, bigger)) {
+    }
+}
+
+static InternTable *successor(InternTable *table) {
+    InternTable *next = atomic_load(&table->next);
+    if (next == NULL) {
+        // Full of other strings, which only happens when inserts race past the load limit
+        grow(table);
+        next = atomic_load(&table->next);
+    }
+    return next;
+}
+
+static ObjString *findOrInsert(InternTable *table, const char *chars, int length, uint32_t hash,
+                               ObjString *candidate) {
+    while (1) {
+        size_t mask = table->capacity - 1;
+        size_t index = hash & mask;
+        bool moved = false;
+
+        for (size_t probes = 0; probes < table->capacity && !moved;) {
+            ObjString *string = atomic_load_explicit(&table->slots[index], memory_order_acquire);
+
+            if (string == NULL) {
+                if (candidate == NULL) return NULL;
+                if (!atomic_compare_exchange_strong(&table->slots[index], &string, candidate)) {
+                    // Lost the slot, look at whatever took it
+                    continue;
+                }
+                if (atomic_fetch_add(&table->count, 1) + 1 > table->capacity / 2) grow(table);
+                return candidate;
+            }
+
+            if (string == FROZEN) {
+                moved = true;
+            } else if (matches(string, chars, length, hash)) {
+                return string;
+            } else {
+                index = (index + 1) & mask;
+                probes++;
+            }
+        }
+        table = successor(table);
+    }
+}
+
+ObjString *sharedIntern(const char *chars, int length, uint32_t hash) {
+    InternTable *table = atomic_load(&root);
+
+    ObjString *string = findOrInsert(table, chars, length, hash, NULL);
+    if (string != NULL) return string;
+
+    // Header and bytes in one block, the string belongs to the process rather than to a VM
+    ObjString *candidate = malloc(sizeof(ObjString) + (size_t) length + 1);
+    if (candidate == NULL) {
+        fprintf(stderr, "Out of memory for the shared intern table.\n");
+        exit(74);
+    }
+    candidate->obj.type = OBJ_STRING;
+    candidate->length = length;
+    candidate->chars = (char *) (candidate + 1);
+    memcpy(candidate->chars, chars, length);
+    candidate->chars[length] = '\0';
+    candidate->hash = hash;
+    candidate->hashed = true;
+    candidate->interned = true;
+    candidate->external = false;
+
+    string = findOrInsert(table, chars, length, hash, candidate);
+    if (string != candidate) {
+        // Another thread interned the same contents first
+        free(candidate);
+        return string;
+    }
+
+    ObjString *head = atomic_load(&allStrings);
+    do {
+        candidate->obj.next = (Obj *) head;
+    } while (!atomic_compare_exchange_weak(&allStrings, &head, candidate));
+    return candidate;
+}
+
+void freeSharedStrings() {
+    ObjString *string = atomic_exchange(&allStrings, NULL);
+    while (string != NULL) {
+        ObjString *next = (ObjString *) string->obj.next;
+        free(string);
+        string = next;
+    }
+
+    InternTable *table = atomic_exchange(&first, NULL);
+    while (table != NULL) {
+        InternTable *next = atomic_load(&table->next);
+        free(table);
+        table = next;
+    }
+    atomic_store(&root, NULL);
+    atomic_store(&enabled, false);
+}
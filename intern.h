@@ -0,0 +1,23 @@
+//
+// Optional process-wide string intern table, shared by every VM and thread.
+//
+
+#ifndef YAVM_INTERN_H
+#define YAVM_INTERN_H
+
+#include "commons.h"
+#include "value.h"
+
+// Routes copyString/takeString/internString of every VM through the shared table. Call it before any VM interns
+// a string. Shared strings live until freeSharedStrings() and are not counted against any VM's heap.
+void enableSharedInterning();
+bool sharedInterningEnabled();
+
+// Finds the shared string with these contents, inserting a copy if there is none. Lock-free and safe to call
+// from any number of threads.
+ObjString* sharedIntern(const char* chars, int length, uint32_t hash);
+
+// Only call once no thread uses shared strings anymore
+void freeSharedStrings();
+
+#endif //YAVM_INTERN_H
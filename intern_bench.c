@@ -0,0 +1,98 @@
+//
+// Measures the throughput of the shared intern table, see intern.h, as the number of threads grows
+//
+// Usage: yavm_intern_bench [max threads] [strings per thread]
+//
+// Every thread interns the same set of names, each starting at a different offset, so the threads race to insert
+// the same strings while the table grows and then mostly find strings another thread inserted. The table starts
+// empty for each thread count.
+//
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "hash.h"
+#include "intern.h"
+#include "prelude.h"
+
+// The benchmark never runs a script, so it starts without a prelude like the bootstrap tool
+_Alignas(8) const unsigned char preludeBytecode[1] = {0};
+const size_t preludeBytecodeSize = 0;
+
+#define MAX_BENCH_THREADS 64
+#define NAME_LENGTH 16
+
+typedef struct {
+    const char* names;
+    const uint32_t* hashes;
+    int count;
+    int offset;
+} Worker;
+
+static void* runWorker(void* argument) {
+    Worker* worker = (Worker*)argument;
+    for (int i = 0; i < worker->count; i++) {
+        int index = (i + worker->offset) % worker->count;
+        const char* name = worker->names + (size_t)index * NAME_LENGTH;
+        sharedIntern(name, NAME_LENGTH - 1, worker->hashes[index]);
+    }
+    return NULL;
+}
+
+// Interns the names on the given number of threads and returns the time it took in seconds
+static double run(int threads, const char* names, const uint32_t* hashes, int count) {
+    pthread_t handles[MAX_BENCH_THREADS];
+    Worker workers[MAX_BENCH_THREADS];
+    struct timespec start, end;
+
+    enableSharedInterning();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < threads; i++) {
+        workers[i] = (Worker){names, hashes, count, (int)((long long)count * i / threads)};
+        if (pthread_create(&handles[i], NULL, runWorker, &workers[i]) != 0) {
+            fprintf(stderr, "Could not start thread %d.\n", i);
+            exit(71);
+        }
+    }
+    for (int i = 0; i < threads; i++) pthread_join(handles[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    freeSharedStrings();
+
+    return (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char* argv[]) {
+    int maxThreads = argc > 1 ? atoi(argv[1]) : 8;
+    int count = argc > 2 ? atoi(argv[2]) : 1000000;
+    if (argc > 3 || maxThreads < 1 || maxThreads > MAX_BENCH_THREADS || count < 1) {
+        fprintf(stderr, "Usage: yavm_intern_bench [max threads, up to %d] [strings per thread]\n",
+                MAX_BENCH_THREADS);
+        exit(64);
+    }
+
+    initHash();
+    char* names = (char*)malloc((size_t)count * NAME_LENGTH);
+    uint32_t* hashes = (uint32_t*)malloc(sizeof(uint32_t) * (size_t)count);
+    if (names == NULL || hashes == NULL) {
+        fprintf(stderr, "Not enough memory for %d names.\n", count);
+        exit(74);
+    }
+    for (int i = 0; i < count; i++) {
+        char* name = names + (size_t)i * NAME_LENGTH;
+        snprintf(name, NAME_LENGTH, "name%011d", i);
+        hashes[i] = hashBytes(name, NAME_LENGTH - 1);
+    }
+
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        double seconds = run(threads, names, hashes, count);
+        double lookups = (double)count * threads;
+        printf("%2d threads: %.0f lookups in %.3f ms, %.2f M/s\n", threads, lookups, seconds * 1e3,
+               seconds > 0 ? lookups / seconds / 1e6 : 0.0);
+    }
+
+    free(hashes);
+    free(names);
+    return 0;
+}
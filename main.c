@@ -1,10 +1,12 @@
-#include "commons.h"
-#include "chunk.h"
-#include "debug.h"          
-#include "vm.h"
+#include "yavm.h"
+#include <signal.h>
 #include <stdio.h> 
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+// The VM every command runs in, for the interrupt handler to cancel
+static YavmVM* vm;
 
 static char* readFile(const char* path) {
     FILE* file = fopen(path, "rb");
@@ -32,15 +34,136 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
-static void runFile(const char* path) {
+static void onInterrupt(int signalNumber) {
+    (void)signalNumber;
+    yavmRequestCancel(vm);
+}
+
+static bool isBytecodePath(const char* path) {
+    size_t length = strlen(path);
+    size_t extension = strlen(YAVM_BYTECODE_EXTENSION);
+    return length > extension && strcmp(path + length - extension, YAVM_BYTECODE_EXTENSION) == 0;
+}
+
+static void exitOnError(YavmResult result) {
+    if (result == YAVM_COMPILE_ERROR) exit(65);
+    if (result == YAVM_RUNTIME_ERROR) exit(70);
+    if (result == YAVM_FILE_ERROR) exit(74);
+}
+
+static void runFile(const char* path, bool stream, const char* cacheDirectory) {
+    // Ctrl-C stops the script cleanly so the limits report and the exit code still apply
+    signal(SIGINT, onInterrupt);
+    YavmResult result;
+    if (isBytecodePath(path)) {
+        result = yavmInterpretBytecode(vm, path);
+    } else if (stream) {
+        result = yavmInterpretStream(vm, path);
+        if (result == YAVM_FILE_ERROR) fprintf(stderr, "Could not open file \"%s\".\n", path);
+    } else {
+        char* source = readFile(path);
+        result = cacheDirectory != NULL ? yavmInterpretCached(vm, source, cacheDirectory) : yavmInterpret(vm, source);
+        free(source);
+    }
+    exitOnError(result);
+}
+
+// Compiles the files side by side, then runs them one after another like a single script
+static void runFiles(const char** paths, int count, int threads) {
+    signal(SIGINT, onInterrupt);
+    char** sources = (char**)malloc(sizeof(char*) * count);
+    if (sources == NULL) {
+        fprintf(stderr, "Not enough memory to read the files.\n");
+        exit(74);
+    }
+    for (int i = 0; i < count; i++) sources[i] = readFile(paths[i]);
+
+    YavmResult result = yavmInterpretAll(vm, (const char**)sources, count, threads);
+
+    for (int i = 0; i < count; i++) free(sources[i]);
+    free(sources);
+    exitOnError(result);
+}
+
+// foo.yavm is compiled to foo.yvmc, any other name gets the extension appended
+static char* bytecodePath(const char* path) {
+    size_t length = strlen(path);
+    const char* sourceExtension = ".yavm";
+    size_t sourceLength = strlen(sourceExtension);
+    if (length > sourceLength && strcmp(path + length - sourceLength, sourceExtension) == 0) length -= sourceLength;
+
+    char* result = (char*)malloc(length + strlen(YAVM_BYTECODE_EXTENSION) + 1);
+    if (result == NULL) {
+        fprintf(stderr, "Not enough memory to name the bytecode files.\n");
+        exit(74);
+    }
+    memcpy(result, path, length);
+    strcpy(result + length, YAVM_BYTECODE_EXTENSION);
+    return result;
+}
+
+// Compiles the files side by side and writes each next to its source without running anything
+static void compileFiles(const char** paths, int count, int threads) {
+    char** sources = (char**)malloc(sizeof(char*) * count);
+    char** outputs = (char**)malloc(sizeof(char*) * count);
+    if (sources == NULL || outputs == NULL) {
+        fprintf(stderr, "Not enough memory to read the files.\n");
+        exit(74);
+    }
+    for (int i = 0; i < count; i++) {
+        sources[i] = readFile(paths[i]);
+        outputs[i] = bytecodePath(paths[i]);
+    }
+
+    YavmResult result = yavmCompileAll(vm, (const char**)sources, (const char**)outputs, count, threads);
+
+    for (int i = 0; i < count; i++) {
+        free(sources[i]);
+        free(outputs[i]);
+    }
+    free(outputs);
+    free(sources);
+    exitOnError(result);
+}
+
+// Writes an image of the state the script at path left behind
+static void takeSnapshot(const char* imagePath, const char* path) {
     char* source = readFile(path);
-    InterpretResult result = interpret(source);
+    YavmResult result = yavmWriteSnapshot(vm, imagePath, source);
     free(source);
+    exitOnError(result);
+}
 
-    if (result == INTERPRET_COMPILE_ERROR) exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+static void loadImage(const char* imagePath) {
+    if (!yavmLoadSnapshot(vm, imagePath)) exit(65);
 }
 
+// Runs the script at path and checks that it builds the same globals as the image
+static void verifyImage(const char* imagePath, const char* path) {
+    char* source = readFile(path);
+    exitOnError(yavmInterpret(vm, source));
+    bool matches = yavmVerifySnapshot(vm, imagePath, source);
+    free(source);
+    if (!matches) exit(65);
+    printf("Snapshot file \"%s\" matches \"%s\".\n", imagePath, path);
+}
+
+// Scans the whole file without compiling it and reports the throughput
+static void scanFile(const char* path) {
+    char* source = readFile(path);
+    size_t length = strlen(source);
+
+    struct timespec start, end;
+    int errors;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int count = yavmScan(vm, source, &errors);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Scanned %zu bytes into %d tokens (%d errors) in %.3f ms, %.1f MB/s\n", length, count, errors,
+           seconds * 1e3, seconds > 0 ? (double)length / seconds / 1e6 : 0.0);
+    free(source);
+}
 
 static void repl() {
     char line[1024];
@@ -52,24 +175,130 @@ static void repl() {
             break;
         }
 
-        interpret(line);
+        yavmInterpret(vm, line);
     }
 }
 
+static void usage() {
+    fprintf(stderr, "Usage: yavm [--heap-limit bytes] [--instruction-budget count] [--map name=path] [--scan] "
+                    "[--stream] [--threads count] [--compile] [--cache dir] [--share-strings] "
+                    "[--snapshot image] [--load-snapshot image] [--verify-snapshot image] [path...]\n");
+    exit(64);
+}
+
 int main(int argc, char* argv[]) {
+    // --share-strings interns every string in the process-wide table, which has to be on before the VM exists
+    bool shareStrings = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--share-strings") == 0) shareStrings = true;
+    }
+    if (shareStrings) yavmShareStrings();
 
-    initVM();
-    if (argc == 1) {
-        repl();
+    vm = yavmNew();
+    if (vm == NULL) {
+        fprintf(stderr, "Not enough memory to start the interpreter.\n");
+        exit(74);
     }
-    else if (argc == 2) {
-        runFile(argv[1]);
+
+    const char** paths = (const char**)malloc(sizeof(char*) * argc);
+    int pathCount = 0;
+    int threads = 0;
+    bool scanOnly = false;
+    bool stream = false;
+    bool compileOnly = false;
+    const char* cacheDirectory = NULL;
+    const char* snapshotPath = NULL;
+    const char* loadPath = NULL;
+    const char* verifyPath = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--heap-limit") == 0 && i + 1 < argc) {
+            yavmSetHeapLimit(vm, strtoull(argv[++i], NULL, 10));
+        } else if (strcmp(argv[i], "--instruction-budget") == 0 && i + 1 < argc) {
+            yavmSetInstructionBudget(vm, strtoull(argv[++i], NULL, 10));
+        } else if (strcmp(argv[i], "--map") == 0 && i + 1 < argc) {
+            // --map name=path binds the file's contents to a global without copying it
+            char* binding = argv[++i];
+            char* separator = strchr(binding, '=');
+            if (separator == NULL) {
+                fprintf(stderr, "Expected name=path after --map.\n");
+                exit(64);
+            }
+            *separator = '\0';
+            if (!yavmDefineMappedString(vm, binding, separator + 1)) {
+                fprintf(stderr, "Could not map file \"%s\".\n", separator + 1);
+                exit(74);
+            }
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            // Threads for compiling several files, 0 for one per core
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--scan") == 0) {
+            scanOnly = true;
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            // Runs each batch of top-level declarations as soon as it compiles, for sources too big to hold compiled
+            stream = true;
+        } else if (strcmp(argv[i], "--compile") == 0) {
+            // Writes each path's bytecode next to it instead of running it
+            compileOnly = true;
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            // Keeps compiled chunks in the directory, so an unchanged source or module is not compiled again
+            cacheDirectory = argv[++i];
+            yavmSetModuleCache(vm, cacheDirectory);
+        } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+            // Writes an image of the globals once the script has run, for --load-snapshot to start from
+            snapshotPath = argv[++i];
+        } else if (strcmp(argv[i], "--load-snapshot") == 0 && i + 1 < argc) {
+            loadPath = argv[++i];
+        } else if (strcmp(argv[i], "--verify-snapshot") == 0 && i + 1 < argc) {
+            // Runs the script and checks that the image was taken from it
+            verifyPath = argv[++i];
+        } else if (strcmp(argv[i], "--share-strings") == 0) {
+            // Handled before the VM was created
+        } else if (argv[i][0] == '-') {
+            usage();
+        } else {
+            paths[pathCount++] = argv[i];
+        }
     }
-    else {
-        fprintf(stderr, "Usage: yavm [path]\n");
-        exit(64);
+    // Scanning and streaming take a single file
+    if (pathCount > 1 && (scanOnly || stream)) usage();
+    // A streamed source is never compiled whole, so there is nothing to cache
+    if ((compileOnly || cacheDirectory != NULL) && (scanOnly || stream)) usage();
+    if (compileOnly && pathCount == 0) usage();
+    // Images are taken of and checked against a single script run from its source
+    if ((snapshotPath != NULL || verifyPath != NULL) &&
+        (pathCount != 1 || scanOnly || stream || compileOnly || isBytecodePath(paths[0]))) {
+        usage();
+    }
+    if (verifyPath != NULL && (snapshotPath != NULL || loadPath != NULL)) usage();
+    for (int i = 0; i < pathCount; i++) {
+        if (isBytecodePath(paths[i]) && (pathCount > 1 || compileOnly || stream || scanOnly)) {
+            fprintf(stderr, "Bytecode files run one at a time.\n");
+            exit(64);
+        }
+    }
+
+    if (loadPath != NULL) loadImage(loadPath);
+    // Several files are run as one script, which imports relative to the working directory
+    if (pathCount == 1) yavmSetScriptPath(vm, paths[0]);
+
+    if (verifyPath != NULL) {
+        verifyImage(verifyPath, paths[0]);
+    } else if (pathCount == 0) {
+        repl();
+    } else if (scanOnly) {
+        scanFile(paths[0]);
+    } else if (compileOnly) {
+        compileFiles(paths, pathCount, threads);
+    } else if (pathCount > 1) {
+        runFiles(paths, pathCount, threads);
+    } else {
+        runFile(paths[0], stream, cacheDirectory);
+        if (snapshotPath != NULL) takeSnapshot(snapshotPath, paths[0]);
     }
+    free(paths);
 
-    freeVM();
+    yavmPrintStats(vm);
+    yavmFree(vm);
+    if (shareStrings) yavmFreeSharedStrings();
 	return 0;
 }
\ No newline at end of file
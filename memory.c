@@ -1,9 +1,216 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// mremap, MAP_HUGETLB and MADV_HUGEPAGE
+#define _GNU_SOURCE
+#endif
 #include "memory.h"
 #include "value.h"
 #include "vm.h"
+#include "profiler.h"
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+// Blocks of a huge page or more get their own mapping, backed by huge pages and placed on the local NUMA node
+#if defined(__linux__) && !defined(NO_LARGE_PAGES)
+#define LARGE_PAGES
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MAPPED_FILES
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef LARGE_PAGES
+#include <sys/syscall.h>
+
+// Used when /proc/meminfo does not give the size, it is the huge page size of x86-64
+#define DEFAULT_HUGE_PAGE_SIZE ((size_t) 2 * 1024 * 1024)
+// From linux/mempolicy.h
+#define MPOL_PREFERRED 1
+#endif
+
+#ifdef DEBUG_MEMORY_STATS
+static MemoryStats stats;
+
+static const char* categoryNames[MEM_CATEGORY_COUNT] = {
+        "chunk_code",
+        "line_tables",
+        "constant_pools",
+        "table_entries",
+        "string_headers",
+        "string_bytes",
+        "vm_stack",
+        "maps",
+        "arrays",
+        "tokens",
+        "locals",
+        "modules",
+        "compile_jobs",
+};
+
+static int sizeBucket(size_t size) {
+    int bucket = 0;
+    while (size > 1 && bucket < MEMORY_HISTOGRAM_BUCKETS - 1) {
+        size >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+static void recordAllocation(void* previous, size_t oldSize, size_t newSize, MemoryCategory category) {
+    if (previous == NULL) {
+        if (newSize == 0) return;
+        stats.allocations++;
+        stats.liveBlocks[category]++;
+    } else if (newSize == 0) {
+        stats.frees++;
+        stats.liveBlocks[category]--;
+    } else {
+        stats.reallocations++;
+    }
+    if (newSize > 0) stats.sizeHistogram[sizeBucket(newSize)]++;
+
+    stats.liveBytes[category] += newSize - oldSize;
+    stats.totalBytes += newSize - oldSize;
+    if (stats.totalBytes > stats.peakBytes) stats.peakBytes = stats.totalBytes;
+}
+
+const MemoryStats* getMemoryStats() {
+    return &stats;
+}
+
+void printMemoryStats(FILE* out) {
+    fprintf(out, "{\n  \"live_bytes\": %zu,\n  \"peak_bytes\": %zu,\n", stats.totalBytes, stats.peakBytes);
+    fprintf(out, "  \"allocations\": %zu,\n  \"reallocations\": %zu,\n  \"frees\": %zu,\n",
+            stats.allocations, stats.reallocations, stats.frees);
+
+    fprintf(out, "  \"categories\": {\n");
+    for (int i = 0; i < MEM_CATEGORY_COUNT; i++) {
+        fprintf(out, "    \"%s\": { \"bytes\": %zu, \"blocks\": %zu }%s\n", categoryNames[i],
+                stats.liveBytes[i], stats.liveBlocks[i], i + 1 < MEM_CATEGORY_COUNT ? "," : "");
+    }
+    fprintf(out, "  },\n");
+
+    // Only print the buckets that were hit, keyed by their lower bound
+    fprintf(out, "  \"size_histogram\": {");
+    bool first = true;
+    for (int i = 0; i < MEMORY_HISTOGRAM_BUCKETS; i++) {
+        if (stats.sizeHistogram[i] == 0) continue;
+        fprintf(out, "%s\n    \"%zu\": %zu", first ? "" : ",", (size_t) 1 << i, stats.sizeHistogram[i]);
+        first = false;
+    }
+    fprintf(out, "\n  }\n}\n");
+}
+#endif
+
+#ifdef LARGE_PAGES
+// Set once by initLargePages() before any VM allocates. arm64 kernels use 32 MB or 512 MB with larger base pages.
+static size_t hugePageSize = DEFAULT_HUGE_PAGE_SIZE;
+
+static bool isLarge(size_t size) {
+    return size >= hugePageSize;
+}
+
+static size_t mappingSize(size_t size) {
+    return (size + hugePageSize - 1) & ~(hugePageSize - 1);
+}
+
+// Prefer the node of the CPU the allocating thread runs on, which is the thread running the VM
+static void bindToLocalNode(void* block, size_t length) {
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0 || node >= 64) return;
+
+    unsigned long nodeMask = 1UL << node;
+    // Failures (no NUMA support, a single node) leave the default first-touch placement
+    syscall(SYS_mbind, block, length, MPOL_PREFERRED, &nodeMask, sizeof(nodeMask) * 8 + 1, 0);
+}
+
+static void* mapLarge(size_t size) {
+    size_t length = mappingSize(size);
+
+    // Explicit huge pages only exist when the administrator reserved some, otherwise ask for transparent ones
+    void* block = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (block == MAP_FAILED) {
+        block = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (block == MAP_FAILED) return NULL;
+        madvise(block, length, MADV_HUGEPAGE);
+    }
+
+    bindToLocalNode(block, length);
+    return block;
+}
+
+// Like realloc, a failure leaves the previous block as it was
+static void* reallocateLarge(void* previous, size_t oldSize, size_t newSize) {
+    if (newSize == 0) {
+        munmap(previous, mappingSize(oldSize));
+        return NULL;
+    }
+
+    if (!isLarge(newSize)) {
+        // Shrinking back under the threshold
+        void* block = malloc(newSize);
+        if (block == NULL) return NULL;
+        memcpy(block, previous, newSize);
+        munmap(previous, mappingSize(oldSize));
+        return block;
+    }
+
+    if (!isLarge(oldSize)) {
+        void* block = mapLarge(newSize);
+        if (block == NULL) return NULL;
+        if (previous != NULL) memcpy(block, previous, oldSize);
+        free(previous);
+        return block;
+    }
+
+    if (mappingSize(oldSize) == mappingSize(newSize)) return previous;
+
+    // Moving the page tables is cheaper than copying, but hugetlb mappings cannot always be remapped
+    void* block = mremap(previous, mappingSize(oldSize), mappingSize(newSize), MREMAP_MAYMOVE);
+    if (block != MAP_FAILED) return block;
+
+    block = mapLarge(newSize);
+    if (block == NULL) return NULL;
+    memcpy(block, previous, oldSize < newSize ? oldSize : newSize);
+    munmap(previous, mappingSize(oldSize));
+    return block;
+}
+#endif
+
+void initLargePages() {
+#ifdef LARGE_PAGES
+    FILE* meminfo = fopen("/proc/meminfo", "r");
+    if (meminfo == NULL) return;
+    char line[128];
+    size_t kilobytes;
+    while (fgets(line, sizeof(line), meminfo) != NULL) {
+        if (sscanf(line, "Hugepagesize: %zu kB", &kilobytes) == 1) {
+            // mappingSize() rounds with a mask
+            if (kilobytes > 0 && (kilobytes & (kilobytes - 1)) == 0) hugePageSize = kilobytes * 1024;
+            break;
+        }
+    }
+    fclose(meminfo);
+#endif
+}
+
+_Thread_local size_t* allocationSink = NULL;
+
+void chargeAllocations(size_t bytes) {
+	vm->bytesAllocated += bytes;
+	if (vm->heapLimit != 0 && vm->bytesAllocated > vm->heapLimit) vm->limitHit = LIMIT_HEAP;
+}
+
+// NULL when newSize is 0, or when the system is out of memory and previous was left alone
+static void* resizeBlock(void* previous, size_t oldSize, size_t newSize) {
+#ifdef LARGE_PAGES
+	if (isLarge(oldSize) || isLarge(newSize)) return reallocateLarge(previous, oldSize, newSize);
+#endif
 
-void* reallocate(void* previous, size_t oldSize, size_t newSize) {
 	if (newSize == 0) {
 		free(previous);
 		return NULL;
@@ -11,21 +218,214 @@ void* reallocate(void* previous, size_t oldSize, size_t newSize) {
 
 	return realloc(previous, newSize);
 }
+
+static void account(void* previous, size_t oldSize, size_t newSize, MemoryCategory category) {
+	if (allocationSink != NULL) {
+		*allocationSink += newSize - oldSize;
+	} else {
+		vm->bytesAllocated += newSize - oldSize;
+		if (newSize > oldSize && vm->heapLimit != 0 && vm->bytesAllocated > vm->heapLimit) {
+			vm->limitHit = LIMIT_HEAP;
+		}
+	}
+#ifdef DEBUG_MEMORY_STATS
+	recordAllocation(previous, oldSize, newSize, category);
+#else
+	// Only the statistics tell blocks apart
+	(void)previous;
+	(void)category;
+#endif
+#ifdef DEBUG_HEAP_PROFILE
+	if (newSize > oldSize) profileAllocation(newSize - oldSize);
+#endif
+}
+
+void* reallocate(void* previous, size_t oldSize, size_t newSize, MemoryCategory category) {
+	void* block = resizeBlock(previous, oldSize, newSize);
+	if (block == NULL && newSize > 0) {
+		fprintf(stderr, "Out of memory.\n");
+		abort();
+	}
+	account(previous, oldSize, newSize, category);
+	return block;
+}
+
+void* tryReallocate(void* previous, size_t oldSize, size_t newSize, MemoryCategory category) {
+	// Allocations counted in a sink belong to no VM yet, so no limit applies to them
+	if (allocationSink == NULL && newSize > oldSize && vm->heapLimit != 0 &&
+		(vm->bytesAllocated >= vm->heapLimit || newSize - oldSize > vm->heapLimit - vm->bytesAllocated)) {
+		vm->limitHit = LIMIT_HEAP;
+		return NULL;
+	}
+	void* block = resizeBlock(previous, oldSize, newSize);
+	if (block == NULL && newSize > 0) {
+		if (allocationSink == NULL) vm->limitHit = LIMIT_MEMORY;
+		return NULL;
+	}
+	account(previous, oldSize, newSize, category);
+	return block;
+}
 static void freeObject(Obj* object) {
     switch (object->type) {
         case OBJ_STRING: {
             ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+            if (!string->external) FREE_ARRAY(char, string->chars, string->length + 1, MEM_STRING_CHARS);
+            FREE(ObjString, object, MEM_STRING_HEADERS);
+            break;
+        }
+        case OBJ_MAP: {
+            ObjMap* map = (ObjMap*)object;
+            freeTable(&map->table);
+            FREE(ObjMap, object, MEM_MAPS);
+            break;
+        }
+        case OBJ_F64ARRAY: {
+            ObjF64Array* array = (ObjF64Array*)object;
+            FREE_ARRAY(double, array->values, array->length, MEM_ARRAYS);
+            FREE(ObjF64Array, object, MEM_ARRAYS);
+            break;
+        }
+        case OBJ_MODULE: {
+            ObjModule* module = (ObjModule*)object;
+            freeTable(&module->globals);
+            FREE(ObjModule, object, MEM_MODULES);
             break;
         }
+        case OBJ_IMPORT:
+            FREE(ObjImport, object, MEM_MODULES);
+            break;
     }
 }
 void freeObjects() {
-    Obj* object = vm.objects;
+    Obj* object = vm->objects;
     while (object != NULL) {
         Obj* next = object->next;
         freeObject(object);
         object = next;
     }
-}
\ No newline at end of file
+}
+
+// With terminated set, the byte after the contents is a '\0' so the mapping can be scanned as a C string
+static MappedFile* mapFileContents(const char* path, bool terminated) {
+    char* data = NULL;
+    size_t size = 0;
+#ifdef MAPPED_FILES
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return NULL;
+    }
+    size = (size_t) info.st_size;
+    if (terminated) {
+        // Zeroed pages one byte longer than the file, with the file mapped over their start. The kernel zero-fills
+        // the rest of the file's last page, and the reserve covers the terminator when the file fills whole pages.
+        data = mmap(NULL, size + 1, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data != MAP_FAILED && size > 0 &&
+            mmap(data, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            munmap(data, size + 1);
+            data = MAP_FAILED;
+        }
+        if (data == MAP_FAILED) data = NULL;
+    } else if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) data = NULL;
+    }
+    close(fd);
+    if ((size > 0 || terminated) && data == NULL) return NULL;
+#else
+    // No mmap, fall back to reading the file into the heap
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+    fseek(file, 0L, SEEK_END);
+    size = (size_t) ftell(file);
+    rewind(file);
+    data = malloc(size + 1);
+    if (data == NULL || fread(data, 1, size, file) < size) {
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+    data[size] = '\0';
+    fclose(file);
+#endif
+
+    MappedFile* mapping = malloc(sizeof(MappedFile));
+    if (mapping == NULL) {
+#ifdef MAPPED_FILES
+        if (data != NULL) munmap(data, size + terminated);
+#else
+        free(data);
+#endif
+        return NULL;
+    }
+    mapping->data = data;
+    mapping->size = size;
+    mapping->terminated = terminated;
+    mapping->next = vm->mappings;
+    vm->mappings = mapping;
+    return mapping;
+}
+
+MappedFile* mapFile(const char* path) {
+    return mapFileContents(path, false);
+}
+
+MappedFile* mapSource(const char* path) {
+    return mapFileContents(path, true);
+}
+
+void releaseMappedPrefix(MappedFile* mapping, size_t offset) {
+#ifdef MAPPED_FILES
+    // Only whole pages can go, and the pages come back from the file if they are touched again
+    size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    size_t length = offset / pageSize * pageSize;
+    if (length > 0) madvise(mapping->data, length, MADV_DONTNEED);
+#endif
+}
+
+static void releaseMapping(MappedFile* mapping) {
+#ifdef MAPPED_FILES
+    if (mapping->data != NULL) munmap(mapping->data, mapping->size + mapping->terminated);
+#else
+    free(mapping->data);
+#endif
+    free(mapping);
+}
+
+void unmapFile(MappedFile* mapping) {
+    MappedFile** link = &vm->mappings;
+    while (*link != mapping) link = &(*link)->next;
+    *link = mapping->next;
+    releaseMapping(mapping);
+}
+
+bool replaceFile(const char* path, const char* data, size_t size) {
+    char temporary[4096];
+#ifdef MAPPED_FILES
+    int length = snprintf(temporary, sizeof(temporary), "%s.%ld.tmp", path, (long) getpid());
+#else
+    int length = snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+#endif
+    if (length <= 0 || (size_t) length >= sizeof(temporary)) return false;
+
+    FILE* out = fopen(temporary, "wb");
+    if (out == NULL) return false;
+    bool written = fwrite(data, 1, size, out) == size;
+    written = fclose(out) == 0 && written;
+    if (written) written = rename(temporary, path) == 0;
+    if (!written) remove(temporary);
+    return written;
+}
+
+void freeMappedFiles() {
+    MappedFile* mapping = vm->mappings;
+    while (mapping != NULL) {
+        MappedFile* next = mapping->next;
+        releaseMapping(mapping);
+        mapping = next;
+    }
+    vm->mappings = NULL;
+}
@@ -6,21 +6,104 @@
 #define GROW_CAPACITY(capacity) \
 		((capacity < 8)?8:2*capacity)
 
-#define GROW_ARRAY(previous, type, oldCount, count)\
-		(type*) reallocate(previous, sizeof(type) * (oldCount), sizeof(type) * (count))
+#define GROW_ARRAY(previous, type, oldCount, count, category)\
+		(type*) reallocate(previous, sizeof(type) * (oldCount), sizeof(type) * (count), category)
 
-#define FREE_ARRAY(type, pointer, oldCount)\
-	reallocate(pointer, sizeof(type) * oldCount, 0)
+#define FREE_ARRAY(type, pointer, oldCount, category)\
+	reallocate(pointer, sizeof(type) * oldCount, 0, category)
 
-#define FREE(type, pointer) \
-    reallocate(pointer, sizeof(type), 0)
+#define FREE(type, pointer, category) \
+    reallocate(pointer, sizeof(type), 0, category)
 
-#define ALLOCATE(type, count) \
-    (type*)reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(type, count, category) \
+    (type*)reallocate(NULL, 0, sizeof(type) * (count), category)
 
+// For blocks whose size the script decides, NULL when the allocation was refused, see tryReallocate()
+#define TRY_ALLOCATE(type, count, category) \
+    (type*)tryReallocate(NULL, 0, sizeof(type) * (count), category)
 
-void* reallocate(void* previous, size_t oldSize, size_t newSize);
+// What a block of memory is used for, so the allocation accounting can tell where the heap went
+typedef enum {
+    MEM_CHUNK_CODE,
+    MEM_LINE_TABLE,
+    MEM_CONSTANTS,
+    MEM_TABLE_ENTRIES,
+    MEM_STRING_HEADERS,
+    MEM_STRING_CHARS,
+    MEM_VM_STACK,
+    MEM_MAPS,
+    MEM_ARRAYS,
+    MEM_TOKENS,
+    MEM_LOCALS,
+    MEM_MODULES,
+    // The job list of a parallel compile, see compileMany()
+    MEM_COMPILE_JOBS,
+
+    MEM_CATEGORY_COUNT
+} MemoryCategory;
+
+// Allocation sizes are bucketed by power of two: bucket i counts requests in [2^i, 2^(i+1))
+#define MEMORY_HISTOGRAM_BUCKETS 32
+
+typedef struct {
+    // bytes and blocks currently allocated per category
+    size_t liveBytes[MEM_CATEGORY_COUNT];
+    size_t liveBlocks[MEM_CATEGORY_COUNT];
+
+    size_t totalBytes;
+    size_t peakBytes;
+
+    size_t allocations;
+    size_t reallocations;
+    size_t frees;
+
+    // sizes requested by allocations and reallocations
+    size_t sizeHistogram[MEMORY_HISTOGRAM_BUCKETS];
+} MemoryStats;
+
+// A read-only file mapped into memory, kept alive until the VM is freed
+typedef struct MappedFile {
+    struct MappedFile* next;
+    char* data;
+    size_t size;
+    // data[size] is a '\0'
+    bool terminated;
+} MappedFile;
+
+// Blocks of a huge page or more get their own mapping unless built with NO_LARGE_PAGES. Reads the huge page size of
+// the system, once per process before the first VM allocates.
+void initLargePages();
+// Never fails, it aborts when the system is out of memory. Growing past the VM's heap limit goes through and sets
+// limitHit, so the interpreter stops at its next check. For the interpreter's own structures, which grow with the
+// source rather than with what the script computes.
+void* reallocate(void* previous, size_t oldSize, size_t newSize, MemoryCategory category);
+// Refuses to grow a block past the VM's heap limit before allocating anything. Returns NULL and sets limitHit when it
+// refuses or the system is out of memory, leaving previous as it was.
+void* tryReallocate(void* previous, size_t oldSize, size_t newSize, MemoryCategory category);
+
+// While set, the allocations of this thread are counted here instead of against the VM, so threads other than the
+// VM's can allocate. Once they are done the VM's thread hands the total over with chargeAllocations().
+extern _Thread_local size_t* allocationSink;
+void chargeAllocations(size_t bytes);
+
+// Maps the whole file and links it into the VM's mappings, NULL if it cannot be read
+MappedFile* mapFile(const char* path);
+// Maps a source file for the scanner, which needs the contents followed by a '\0'
+MappedFile* mapSource(const char* path);
+// Gives back the memory behind the mapping's first offset bytes, which must not be read again soon
+void releaseMappedPrefix(MappedFile* mapping, size_t offset);
+// Unmaps a file that nothing points into
+void unmapFile(MappedFile* mapping);
+// Writes the file under a temporary name and renames it over path, so processes that have the old file mapped keep
+// reading the old contents
+bool replaceFile(const char* path, const char* data, size_t size);
+void freeMappedFiles();
 
 void freeObjects();
 
-#endif // !memory_h
\ No newline at end of file
+#ifdef DEBUG_MEMORY_STATS
+const MemoryStats* getMemoryStats();
+void printMemoryStats(FILE* out);
+#endif
+
+#endif // !memory_h
@@ -0,0 +1,111 @@
+//
+// Modules, see module.h
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "compiler.h"
+#include "memory.h"
+#include "module.h"
+#include "vm.h"
+
+// Length of the directory part of path, including the last separator
+static size_t directoryLength(const char* path) {
+    const char* separator = strrchr(path, '/');
+#ifdef _WIN32
+    const char* backslash = strrchr(path, '\\');
+    if (backslash != NULL && (separator == NULL || backslash > separator)) separator = backslash;
+#endif
+    return separator == NULL ? 0 : (size_t) (separator - path + 1);
+}
+
+static bool isAbsolute(const char* path) {
+#ifdef _WIN32
+    if (path[0] != '\0' && path[1] == ':') return true;
+    if (path[0] == '\\') return true;
+#endif
+    return path[0] == '/';
+}
+
+// The path with . and .. resolved and symbolic links followed, so every way of naming a file finds the same module
+static char* canonicalPath(const char* path) {
+#ifdef _WIN32
+    return _fullpath(NULL, path, 0);
+#else
+    return realpath(path, NULL);
+#endif
+}
+
+ObjModule* findModule(ObjString* path) {
+    const char* base = "";
+    size_t baseLength = 0;
+    if (!isAbsolute(path->chars)) {
+        if (vm->module != NULL) {
+            base = vm->module->path->chars;
+            baseLength = directoryLength(base);
+        } else if (vm->scriptDirectory != NULL) {
+            base = vm->scriptDirectory;
+            baseLength = strlen(base);
+        }
+    }
+
+    char* joined = malloc(baseLength + (size_t) path->length + 1);
+    if (joined == NULL) return NULL;
+    memcpy(joined, base, baseLength);
+    memcpy(joined + baseLength, path->chars, (size_t) path->length);
+    joined[baseLength + path->length] = '\0';
+    char* canonical = canonicalPath(joined);
+    free(joined);
+    if (canonical == NULL) return NULL;
+
+    ObjString* key = copyString(canonical, (int) strlen(canonical));
+    free(canonical);
+    Value module;
+    if (tableGet(&vm->modules, key, &module)) return AS_MODULE(module);
+
+    ObjModule* created = newModule(key);
+    tableSet(&vm->modules, key, OBJ_VAL(created));
+    return created;
+}
+
+Chunk* moduleChunk(ObjModule* module) {
+    MappedFile* source = mapSource(module->path->chars);
+    if (source == NULL) return NULL;
+
+    uint64_t fingerprint = sourceFingerprint(source->data);
+    for (ModuleChunk* cached = vm->moduleChunks; cached != NULL; cached = cached->next) {
+        if (cached->fingerprint == fingerprint) {
+            unmapFile(source);
+            return &cached->chunk;
+        }
+    }
+
+    ModuleChunk* compiled = ALLOCATE(ModuleChunk, 1, MEM_MODULES);
+    initChunk(&compiled->chunk);
+    // Compiled chunks hold copies of the strings in the source, so it can go right away
+    bool ok = vm->cacheDirectory != NULL ? compileCached(source->data, &compiled->chunk, vm->cacheDirectory)
+                                         : compile(source->data, &compiled->chunk);
+    unmapFile(source);
+    if (!ok) {
+        freeChunk(&compiled->chunk);
+        FREE(ModuleChunk, compiled, MEM_MODULES);
+        return NULL;
+    }
+    compiled->fingerprint = fingerprint;
+    compiled->next = vm->moduleChunks;
+    vm->moduleChunks = compiled;
+    return &compiled->chunk;
+}
+
+void freeModuleChunks() {
+    ModuleChunk* compiled = vm->moduleChunks;
+    while (compiled != NULL) {
+        ModuleChunk* next = compiled->next;
+        freeChunk(&compiled->chunk);
+        FREE(ModuleChunk, compiled, MEM_MODULES);
+        compiled = next;
+    }
+    vm->moduleChunks = NULL;
+}
@@ -0,0 +1,27 @@
+//
+// Finding and compiling the modules loaded by import. Running them is up to the VM.
+//
+
+#ifndef YAVM_MODULE_H
+#define YAVM_MODULE_H
+
+#include "chunk.h"
+#include "commons.h"
+#include "object.h"
+
+// A compiled module source, kept for the life of the VM so a module with the same contents is never compiled again
+typedef struct ModuleChunk {
+    struct ModuleChunk* next;
+    uint64_t fingerprint;
+    Chunk chunk;
+} ModuleChunk;
+
+// The module at path, which is relative to the directory of the module running now, or of the main script outside
+// of modules. The module is made, but not loaded, the first time its file is named. NULL if there is no such file.
+ObjModule* findModule(ObjString* path);
+
+// The compiled source of the module, NULL if it cannot be read or has compile errors, which are reported
+Chunk* moduleChunk(ObjModule* module);
+void freeModuleChunks();
+
+#endif //YAVM_MODULE_H
@@ -5,54 +5,56 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "hash.h"
+#include "intern.h"
 #include "memory.h"
 #include "object.h"
 #include "value.h"
 #include "vm.h"
 
-#define ALLOCATE_OBJ(type, objectType) \
-    (type*)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(type, objectType, category) \
+    (type*)allocateObject(sizeof(type), objectType, category)
 
-static Obj *allocateObject(size_t size, ObjType type) {
-    Obj *object = (Obj *) reallocate(NULL, 0, size);
+static Obj *allocateObject(size_t size, ObjType type, MemoryCategory category) {
+    Obj *object = (Obj *) reallocate(NULL, 0, size, category);
     object->type = type;
 
-    object->next = vm.objects;
-    vm.objects = object;
+    object->next = vm->objects;
+    vm->objects = object;
 
     return object;
 }
 
 static ObjString *allocateStringObj(char *chars, int length, uint32_t hash) {
-    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING, MEM_STRING_HEADERS);
     string->length = length;
     string->chars = chars;
     string->hash = hash;
+    string->hashed = true;
+    string->interned = true;
+    string->external = false;
 
     // String interning
-    tableSet(&vm.strings, string, NIL_VAL);
+    tableSet(&vm->strings, string, NIL_VAL);
 
     return string;
 }
 
-// FNV-1a hash function
 static uint32_t hashString(const char* key, int length) {
-    uint32_t hash = 2166136261u;
-
-    for (int i = 0; i < length; i++) {
-        hash ^= key[i];
-        hash *= 16777619;
-    }
-
-    return hash;
+    return hashBytes(key, (size_t) length);
 }
 
 ObjString *takeString(char *chars, int length) {
     uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length,
+    if (sharedInterningEnabled()) {
+        ObjString *shared = sharedIntern(chars, length, hash);
+        FREE_ARRAY(char, chars, length + 1, MEM_STRING_CHARS);
+        return shared;
+    }
+    ObjString* interned = tableFindString(&vm->strings, chars, length,
                                           hash);
     if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
+        FREE_ARRAY(char, chars, length + 1, MEM_STRING_CHARS);
         return interned;
     }
     return allocateStringObj(chars, length, hash);
@@ -61,13 +63,128 @@ ObjString *takeString(char *chars, int length) {
 
 ObjString *copyString(const char *chars, int length) {
     uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length,
+    if (sharedInterningEnabled()) return sharedIntern(chars, length, hash);
+    ObjString* interned = tableFindString(&vm->strings, chars, length,
                                           hash);
     if (interned != NULL) return interned;
 
-    char *heapChars = ALLOCATE(char, length + 1);
+    char *heapChars = ALLOCATE(char, length + 1, MEM_STRING_CHARS);
     memcpy(heapChars, chars, length);
     heapChars[length] = '\0';
 
     return allocateStringObj(heapChars, length, hash);
 }
+
+ObjString *makeString(char *chars, int length) {
+    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING, MEM_STRING_HEADERS);
+    string->length = length;
+    string->chars = chars;
+    string->hash = 0;
+    string->hashed = false;
+    string->interned = false;
+    string->external = false;
+    return string;
+}
+
+ObjString *detachedString(const char *chars, int length, uint32_t hash) {
+    ObjString *string = ALLOCATE(ObjString, 1, MEM_STRING_HEADERS);
+    string->obj.type = OBJ_STRING;
+    string->obj.next = NULL;
+
+    char *heapChars = ALLOCATE(char, length + 1, MEM_STRING_CHARS);
+    memcpy(heapChars, chars, length);
+    heapChars[length] = '\0';
+
+    string->length = length;
+    string->chars = heapChars;
+    string->hash = hash;
+    string->hashed = true;
+    string->interned = false;
+    string->external = false;
+    return string;
+}
+
+void freeDetachedString(ObjString *string) {
+    FREE_ARRAY(char, string->chars, string->length + 1, MEM_STRING_CHARS);
+    FREE(ObjString, string, MEM_STRING_HEADERS);
+}
+
+ObjString *externalString(const char *chars, int length) {
+    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING, MEM_STRING_HEADERS);
+    string->length = length;
+    string->chars = (char *) chars;
+    string->hash = 0;
+    string->hashed = false;
+    string->interned = false;
+    string->external = true;
+    return string;
+}
+
+uint32_t stringHash(ObjString *string) {
+    if (!string->hashed) {
+        string->hash = hashString(string->chars, string->length);
+        string->hashed = true;
+    }
+    return string->hash;
+}
+
+ObjString *internString(ObjString *string) {
+    if (string->interned) return string;
+
+    uint32_t hash = stringHash(string);
+    if (sharedInterningEnabled()) return sharedIntern(string->chars, string->length, hash);
+
+    ObjString *interned = tableFindString(&vm->strings, string->chars, string->length, hash);
+    if (interned != NULL) return interned;
+
+    string->interned = true;
+    tableSet(&vm->strings, string, NIL_VAL);
+    return string;
+}
+
+bool stringsEqual(ObjString *a, ObjString *b) {
+    if (a == b) return true;
+    // Interned strings with the same contents are the same object
+    if (a->interned && b->interned) return false;
+    if (a->length != b->length) return false;
+    if (a->hashed && b->hashed && a->hash != b->hash) return false;
+    return bytesEqual(a->chars, b->chars, (size_t) a->length);
+}
+
+ObjMap *newMap(int capacity) {
+    ObjMap *map = ALLOCATE_OBJ(ObjMap, OBJ_MAP, MEM_MAPS);
+    initTable(&map->table);
+    // The empty map stays in the object list and is freed with the rest
+    if (!tableReserve(&map->table, capacity)) return NULL;
+    return map;
+}
+
+ObjF64Array *newArray(int length) {
+    double *values = NULL;
+    if (length > 0) {
+        values = TRY_ALLOCATE(double, length, MEM_ARRAYS);
+        if (values == NULL) return NULL;
+        memset(values, 0, sizeof(double) * length);
+    }
+    ObjF64Array *array = ALLOCATE_OBJ(ObjF64Array, OBJ_F64ARRAY, MEM_ARRAYS);
+    array->length = length;
+    array->values = values;
+    return array;
+}
+
+ObjModule *newModule(ObjString *path) {
+    ObjModule *module = ALLOCATE_OBJ(ObjModule, OBJ_MODULE, MEM_MODULES);
+    module->path = path;
+    module->state = MODULE_UNLOADED;
+    initTable(&module->globals);
+    tableAddAll(&vm->prelude, &module->globals);
+    return module;
+}
+
+ObjImport *newImport(ObjModule *module, ObjString *name) {
+    ObjImport *import = ALLOCATE_OBJ(ObjImport, OBJ_IMPORT, MEM_MODULES);
+    import->module = module;
+    import->name = name;
+    import->resolving = false;
+    return import;
+}
@@ -6,18 +6,30 @@
 #define YAVM_OBJECT_H
 #include "commons.h"
 #include "value.h"
+#include "table.h"
 
 
 #define OBJ_TYPE(value)         (AS_OBJ(value)->type)
 
 #define IS_STRING(value)        isObjType(value, OBJ_STRING)
+#define IS_MAP(value)           isObjType(value, OBJ_MAP)
+#define IS_ARRAY(value)         isObjType(value, OBJ_F64ARRAY)
+#define IS_IMPORT(value)        isObjType(value, OBJ_IMPORT)
 
 #define AS_STRING(value)        ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)       (((ObjString*)AS_OBJ(value))->chars)
+#define AS_MAP(value)           ((ObjMap*)AS_OBJ(value))
+#define AS_ARRAY(value)         ((ObjF64Array*)AS_OBJ(value))
+#define AS_MODULE(value)        ((ObjModule*)AS_OBJ(value))
+#define AS_IMPORT(value)        ((ObjImport*)AS_OBJ(value))
 
 
 typedef enum {
     OBJ_STRING,
+    OBJ_MAP,
+    OBJ_F64ARRAY,
+    OBJ_MODULE,
+    OBJ_IMPORT,
 } ObjType;
 
 struct sObj {
@@ -33,14 +45,79 @@ struct sObjString {
     char* chars;
 
     uint32_t hash;
+    // Strings that are not interned only hash themselves when they are first used as a key
+    bool hashed;
+    bool interned;
+    // chars point into a file mapped by the VM rather than into the heap
+    bool external;
 };
+// Keys are interned strings, like the VM's globals
+typedef struct {
+    Obj obj;
+    Table table;
+} ObjMap;
+// Fixed-length array of numbers stored unboxed, so bulk operations can run over it with vector instructions
+typedef struct {
+    Obj obj;
+    int length;
+    double* values;
+} ObjF64Array;
+
+typedef enum {
+    MODULE_UNLOADED,
+    MODULE_LOADING,
+    MODULE_LOADED,
+    MODULE_FAILED
+} ModuleState;
+// A source file loaded by import, which runs at most once per VM with globals of its own
+typedef struct {
+    Obj obj;
+    // Canonical path of the source, which identifies the module
+    ObjString* path;
+    Table globals;
+    ModuleState state;
+} ObjModule;
+// A global bound by import. Reading the global loads the module and replaces the import with the name's value.
+typedef struct {
+    Obj obj;
+    ObjModule* module;
+    ObjString* name;
+    // Set while the name is looked up, so names imported from each other in a circle are caught
+    bool resolving;
+} ObjImport;
+
 ObjString* takeString(char* chars, int length);
+// Takes ownership of chars without hashing or interning them, for results that may never be used as a key
+ObjString* makeString(char* chars, int length);
 
 static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
 ObjString* copyString(const char* chars, int length);
+// A copy of chars that is neither interned nor linked into the VM's objects, so any thread can make one. It is freed
+// with freeDetachedString().
+ObjString* detachedString(const char* chars, int length, uint32_t hash);
+void freeDetachedString(ObjString* string);
+// Wraps bytes owned by a mapping of the VM without copying or hashing them
+ObjString* externalString(const char* chars, int length);
+
+uint32_t stringHash(ObjString* string);
+// Returns the interned string with the same contents, interning string itself if there is none yet
+ObjString* internString(ObjString* string);
+bool stringsEqual(ObjString* a, ObjString* b);
+
+// The longest array, 2 GiB of doubles
+#define ARRAY_MAX_LENGTH (1 << 28)
+
+// A map with room for capacity entries before its first resize, NULL when the room could not be allocated
+ObjMap* newMap(int capacity);
+// An array of length zeros, at most ARRAY_MAX_LENGTH. NULL past the heap limit or out of memory, with the VM's limitHit
+// saying which.
+ObjF64Array* newArray(int length);
+// A module that has not run yet, whose globals start out as the prelude's
+ObjModule* newModule(ObjString* path);
+ObjImport* newImport(ObjModule* module, ObjString* name);
 
 
 #endif //YAVM_OBJECT_H
@@ -0,0 +1,15 @@
+//
+// The prelude, definitions every script starts with. prelude.yavm is compiled by the bootstrap tool at build time
+// and linked into the interpreter as a bytecode file, see bootstrap.c.
+//
+
+#ifndef YAVM_PRELUDE_H
+#define YAVM_PRELUDE_H
+
+#include "commons.h"
+
+// 8-byte aligned like a mapped file, preludeBytecodeSize is 0 when there is no prelude
+extern const unsigned char preludeBytecode[];
+extern const size_t preludeBytecodeSize;
+
+#endif //YAVM_PRELUDE_H
@@ -0,0 +1,151 @@
+//
+// Heap profiler: attributes allocations to the bytecode and source line that caused them.
+//
+
+#include "profiler.h"
+
+#ifdef DEBUG_HEAP_PROFILE
+
+#include <stdlib.h>
+
+#include "debug.h"
+#include "vm.h"
+
+// Opcode recorded for allocations made while compiling
+#define SITE_COMPILE -1
+
+typedef struct {
+    int line;
+    int opcode;
+    size_t bytes;
+    size_t count;
+} Site;
+
+// Sites are kept in their own open-addressed table so that recording does not go through reallocate() itself
+static Site* sites = NULL;
+static int siteCount = 0;
+static int siteCapacity = 0;
+
+static int sampleRate = 1;
+static int untilSample = 1;
+static int compileLine = 0;
+
+static uint32_t hashSite(int line, int opcode) {
+    uint32_t hash = (uint32_t) line * 2654435761u;
+    return hash ^ ((uint32_t) opcode * 40503u);
+}
+
+static Site* findSite(Site* table, int capacity, int line, int opcode) {
+    uint32_t index = hashSite(line, opcode) & (capacity - 1);
+    while (1) {
+        Site* site = &table[index];
+        if (site->count == 0 || (site->line == line && site->opcode == opcode)) return site;
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+static void growSites() {
+    int capacity = siteCapacity < 64 ? 64 : siteCapacity * 2;
+    Site* table = calloc(capacity, sizeof(Site));
+    if (table == NULL) return;
+
+    for (int i = 0; i < siteCapacity; i++) {
+        if (sites[i].count == 0) continue;
+        *findSite(table, capacity, sites[i].line, sites[i].opcode) = sites[i];
+    }
+    free(sites);
+    sites = table;
+    siteCapacity = capacity;
+}
+
+void profileAllocation(size_t bytes) {
+    if (--untilSample > 0) return;
+    untilSample = sampleRate;
+
+    if (siteCount + 1 > siteCapacity / 2) growSites();
+    if (sites == NULL) return;
+
+    int line;
+    int opcode;
+    if (vm->chunk == NULL) {
+        line = compileLine;
+        opcode = SITE_COMPILE;
+    } else {
+        int offset = (int) (vm->instruction - vm->chunk->code);
+        line = getLine(vm->chunk, offset);
+        opcode = *vm->instruction;
+    }
+
+    Site* site = findSite(sites, siteCapacity, line, opcode);
+    if (site->count == 0) {
+        site->line = line;
+        site->opcode = opcode;
+        siteCount++;
+    }
+    site->bytes += bytes * sampleRate;
+    site->count += sampleRate;
+}
+
+void profileCompileLine(int line) {
+    compileLine = line;
+}
+
+void setHeapProfileSampleRate(int rate) {
+    sampleRate = rate < 1 ? 1 : rate;
+    untilSample = sampleRate;
+}
+
+static const char* siteName(Site* site) {
+    return site->opcode == SITE_COMPILE ? "compile" : opcodeName((uint8_t) site->opcode);
+}
+
+void writeHeapProfile(FILE* out) {
+    for (int i = 0; i < siteCapacity; i++) {
+        Site* site = &sites[i];
+        if (site->count == 0) continue;
+        if (site->opcode == SITE_COMPILE) {
+            fprintf(out, "compile;line %d %zu\n", site->line, site->bytes);
+        } else {
+            fprintf(out, "script;line %d;%s %zu\n", site->line, siteName(site), site->bytes);
+        }
+    }
+}
+
+static int compareSites(const void* a, const void* b) {
+    size_t bytesA = ((const Site*) a)->bytes;
+    size_t bytesB = ((const Site*) b)->bytes;
+    return bytesA < bytesB ? 1 : bytesA > bytesB ? -1 : 0;
+}
+
+void printHeapProfileReport(FILE* out, int top) {
+    Site* sorted = malloc(sizeof(Site) * (siteCount > 0 ? siteCount : 1));
+    if (sorted == NULL) return;
+
+    int count = 0;
+    size_t totalBytes = 0;
+    for (int i = 0; i < siteCapacity; i++) {
+        if (sites[i].count == 0) continue;
+        sorted[count++] = sites[i];
+        totalBytes += sites[i].bytes;
+    }
+    qsort(sorted, count, sizeof(Site), compareSites);
+
+    fprintf(out, "== heap profile (1 in %d allocations sampled) ==\n", sampleRate);
+    fprintf(out, "%12s %6s %10s  %s\n", "bytes", "%", "count", "site");
+    for (int i = 0; i < count && i < top; i++) {
+        Site* site = &sorted[i];
+        fprintf(out, "%12zu %5.1f%% %10zu  line %d %s\n", site->bytes,
+                totalBytes == 0 ? 0.0 : 100.0 * site->bytes / totalBytes, site->count,
+                site->line, siteName(site));
+    }
+    free(sorted);
+}
+
+void freeHeapProfile() {
+    free(sites);
+    sites = NULL;
+    siteCount = 0;
+    siteCapacity = 0;
+}
+
+#endif
@@ -0,0 +1,29 @@
+//
+// Heap profiler: attributes allocations to the bytecode and source line that caused them.
+//
+
+#ifndef YAVM_PROFILER_H
+#define YAVM_PROFILER_H
+
+#include "commons.h"
+
+#ifdef DEBUG_HEAP_PROFILE
+
+// Record one allocation of the given size against the current site
+void profileAllocation(size_t bytes);
+
+// Source line the compiler is at, used for allocations made while compiling
+void profileCompileLine(int line);
+
+// Only record one in every rate allocations, scaling the recorded sizes back up
+void setHeapProfileSampleRate(int rate);
+
+// Collapsed stacks ("phase;line;opcode bytes"), readable by flamegraph.pl and speedscope
+void writeHeapProfile(FILE* out);
+void printHeapProfileReport(FILE* out, int top);
+
+void freeHeapProfile();
+
+#endif
+
+#endif //YAVM_PROFILER_H
@@ -1,205 +1,536 @@
 #include "scanner.h"
 
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>   
 
 #include "commons.h"
-typedef struct {
-    const char* start;
-    const char* current;
-    int line;
-} Scanner;
-
-Scanner scanner;
+#include "memory.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-static bool isAtEnd() {
-    return *scanner.current == '\0';
+static bool isAtEnd(Scanner* scanner) {
+    return *scanner->current == '\0';
 }
 
+#define CHAR_DIGIT 1
+#define CHAR_ALPHA 2
+
+#define DIGITS(c) [c] = CHAR_DIGIT
+#define LETTERS(c) [c] = CHAR_ALPHA, [c - 'a' + 'A'] = CHAR_ALPHA
+
+// One lookup per character instead of a chain of range checks
+static const uint8_t charClasses[256] = {
+        DIGITS('0'), DIGITS('1'), DIGITS('2'), DIGITS('3'), DIGITS('4'),
+        DIGITS('5'), DIGITS('6'), DIGITS('7'), DIGITS('8'), DIGITS('9'),
+        LETTERS('a'), LETTERS('b'), LETTERS('c'), LETTERS('d'), LETTERS('e'), LETTERS('f'), LETTERS('g'),
+        LETTERS('h'), LETTERS('i'), LETTERS('j'), LETTERS('k'), LETTERS('l'), LETTERS('m'), LETTERS('n'),
+        LETTERS('o'), LETTERS('p'), LETTERS('q'), LETTERS('r'), LETTERS('s'), LETTERS('t'), LETTERS('u'),
+        LETTERS('v'), LETTERS('w'), LETTERS('x'), LETTERS('y'), LETTERS('z'),
+        ['_'] = CHAR_ALPHA,
+};
+
+#undef DIGITS
+#undef LETTERS
+
 static bool isDigit(char c) {
-    return c <= '9' && c >= '0';
+    return charClasses[(uint8_t)c] & CHAR_DIGIT;
 }
 
 static bool isAlpha(char c) {
-    return (c >= 'a' && c <= 'z') ||
-        (c >= 'A' && c <= 'Z') ||
-        c == '_';
+    return charClasses[(uint8_t)c] & CHAR_ALPHA;
 }
 
-static char peek() {
-    return *scanner.current;
+static bool isWordChar(char c) {
+    return charClasses[(uint8_t)c] != 0;
 }
-static char peekNext() {
-    if (isAtEnd()) return '\0';
-    return scanner.current[1];
+
+static char peek(Scanner* scanner) {
+    return *scanner->current;
+}
+static char peekNext(Scanner* scanner) {
+    if (isAtEnd(scanner)) return '\0';
+    return scanner->current[1];
 }
-static char advance() {
-    scanner.current++;
-    return scanner.current[-1];
+static char advance(Scanner* scanner) {
+    scanner->current++;
+    return scanner->current[-1];
 }
-static bool match(char expected) {
-    if (isAtEnd() || *scanner.current != expected) return false;
-    scanner.current++;
+static bool match(Scanner* scanner, char expected) {
+    if (isAtEnd(scanner) || *scanner->current != expected) return false;
+    scanner->current++;
     return true;
 }
-static Token makeToken(TokenType type) {
+static Token makeToken(Scanner* scanner, TokenType type) {
     Token token;
     token.type = type;
-    token.start = scanner.start;
-    token.length = (int)(scanner.current - scanner.start);
-    token.line = scanner.line;
+    token.start = scanner->start;
+    token.length = (int)(scanner->current - scanner->start);
+    token.line = scanner->line;
 
     return token;
 }
 
 
-static Token errorToken(const char* message) {
+static Token errorToken(Scanner* scanner, const char* message) {
     Token token;
     token.type = TOKEN_ERROR;
     token.start = message;
     token.length = (int)strlen(message);
-    token.line = scanner.line;
+    token.line = scanner->line;
 
     return token;
 }
 
 
-void initScanner(const char* source)
+void initScanner(Scanner* scanner, const char* source)
 {
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+    scanner->start = source;
+    scanner->current = source;
+    scanner->line = 1;
+}
+
+#ifdef __SSE2__
+#define BLOCK_SIZE 16
+
+// Loads the 16 bytes at p. The load may read past the terminator, so it is only made when it stays within p's page.
+__attribute__((no_sanitize_address))
+static bool loadBlock(const char* p, __m128i* block) {
+    if (((uintptr_t)p & 4095) > 4096 - BLOCK_SIZE) return false;
+    *block = _mm_loadu_si128((const __m128i*)p);
+    return true;
 }
 
-static void skipWhitespace() {
+static unsigned matchByte(__m128i block, char c) {
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(c)));
+}
+
+// Bytes in [low, high]. Bytes from 0x80 up compare as negative and never match.
+static __m128i inRange(__m128i block, char low, char high) {
+    return _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8((char)(low - 1))),
+                         _mm_cmplt_epi8(block, _mm_set1_epi8((char)(high + 1))));
+}
+
+// Newlines among the first count bytes of a block
+static int countLines(unsigned newlines, int count) {
+    return __builtin_popcount(newlines & ((1u << count) - 1));
+}
+#endif
+
+static void skipComment(Scanner* scanner) {
     for (;;) {
-        char c = peek();
+#ifdef __SSE2__
+        __m128i block;
+        if (loadBlock(scanner->current, &block)) {
+            unsigned stop = matchByte(block, '\n') | matchByte(block, '\0');
+            if (stop == 0) {
+                scanner->current += BLOCK_SIZE;
+                continue;
+            }
+            scanner->current += __builtin_ctz(stop);
+            return;
+        }
+#endif
+        if (peek(scanner) == '\n' || isAtEnd(scanner)) return;
+        advance(scanner);
+    }
+}
+
+static bool isSpace(char c) {
+    return c == ' ' || c == '\r' || c == '\t' || c == '\n';
+}
+
+// Skips whitespace 16 bytes at a time. Only worth it for runs such as indentation, single spaces are left to the
+// caller.
+static void skipSpaceRun(Scanner* scanner) {
+#ifdef __SSE2__
+    __m128i block;
+    while (loadBlock(scanner->current, &block)) {
+        unsigned newlines = matchByte(block, '\n');
+        unsigned space = newlines | matchByte(block, ' ') | matchByte(block, '\r') | matchByte(block, '\t');
+        if (space != 0xffff) {
+            int run = __builtin_ctz(~space);
+            scanner->line += countLines(newlines, run);
+            scanner->current += run;
+            return;
+        }
+        scanner->line += __builtin_popcount(newlines);
+        scanner->current += BLOCK_SIZE;
+    }
+#endif
+}
+
+static void skipWhitespace(Scanner* scanner) {
+    for (;;) {
+        char c = peek(scanner);
         switch (c) {
         case ' ':
         case '\r':
         case '\t':
-            advance();
+            advance(scanner);
+            if (isSpace(peek(scanner))) skipSpaceRun(scanner);
             break;
         case '\n':
-            scanner.line++;
-            advance();
+            scanner->line++;
+            advance(scanner);
+            if (isSpace(peek(scanner))) skipSpaceRun(scanner);
             break;
         case '/':
-            if (peekNext() == '/')
-                while (peek() != '\n' && !isAtEnd()) advance();
+            if (peekNext(scanner) == '/')
+                skipComment(scanner);
             else
                 return;
+            break;
         default:
             return;
         }
     }
 }
-static TokenType checkKeyword(int start, int length,
-    const char* rest, TokenType type) {
-    if (scanner.current - scanner.start == start + length &&
-        memcmp(scanner.start + start, rest, length) == 0) {
-        return type;
-    }
-
-    return TOKEN_IDENTIFIER;
-}
-static Token string() {
-    while (peek() != '"' && !isAtEnd()) {
-        if (peek() == '\n') scanner.line++;
-        advance();
+static Token string(Scanner* scanner) {
+    for (;;) {
+#ifdef __SSE2__
+        __m128i block;
+        if (loadBlock(scanner->current, &block)) {
+            unsigned newlines = matchByte(block, '\n');
+            unsigned stop = matchByte(block, '"') | matchByte(block, '\0');
+            if (stop == 0) {
+                scanner->line += __builtin_popcount(newlines);
+                scanner->current += BLOCK_SIZE;
+                continue;
+            }
+            int run = __builtin_ctz(stop);
+            scanner->line += countLines(newlines, run);
+            scanner->current += run;
+            break;
+        }
+#endif
+        if (peek(scanner) == '"' || isAtEnd(scanner)) break;
+        if (peek(scanner) == '\n') scanner->line++;
+        advance(scanner);
     }
 
-    if (isAtEnd()) return errorToken("Unterminated string.");
+    if (isAtEnd(scanner)) return errorToken(scanner, "Unterminated string.");
 
     // The closing quote.                                    
-    advance();
-    return makeToken(TOKEN_STRING);
+    advance(scanner);
+    return makeToken(scanner, TOKEN_STRING);
 }
-static TokenType identifierType()
+// Keywords are at least two characters long, so a slot is picked from the first two characters and the length. The
+// multiplier was chosen so no two keywords share a slot.
+#define KEYWORD_SLOTS 64
+#define KEYWORD_SLOT(first, second, length) (((first) + (second) * 10 + (length)) & (KEYWORD_SLOTS - 1))
+// The first two characters are spelled out because indexing a string literal is not a constant expression
+#define KEYWORD(first, second, name, type) [KEYWORD_SLOT(first, second, sizeof(name) - 1)] = {name, sizeof(name) - 1, type}
+
+typedef struct {
+    const char* name;
+    int length;
+    TokenType type;
+} Keyword;
+
+static const Keyword keywords[KEYWORD_SLOTS] = {
+        KEYWORD('a', 'n', "and", TOKEN_AND),
+        KEYWORD('c', 'l', "class", TOKEN_CLASS),
+        KEYWORD('e', 'l', "else", TOKEN_ELSE),
+        KEYWORD('f', 'a', "false", TOKEN_FALSE),
+        KEYWORD('f', 'o', "for", TOKEN_FOR),
+        KEYWORD('f', 'r', "from", TOKEN_FROM),
+        KEYWORD('f', 'u', "fun", TOKEN_FUN),
+        KEYWORD('i', 'f', "if", TOKEN_IF),
+        KEYWORD('i', 'm', "import", TOKEN_IMPORT),
+        KEYWORD('n', 'i', "nil", TOKEN_NIL),
+        KEYWORD('o', 'r', "or", TOKEN_OR),
+        KEYWORD('p', 'r', "print", TOKEN_PRINT),
+        KEYWORD('r', 'e', "return", TOKEN_RETURN),
+        KEYWORD('s', 'u', "super", TOKEN_SUPER),
+        KEYWORD('t', 'h', "this", TOKEN_THIS),
+        KEYWORD('t', 'r', "true", TOKEN_TRUE),
+        KEYWORD('v', 'a', "var", TOKEN_VAR),
+        KEYWORD('w', 'h', "while", TOKEN_WHILE),
+};
+
+static TokenType identifierType(Scanner* scanner)
 {
-    switch (scanner.start[0]) {
-        case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-        case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-        case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-        case 'f':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-                    case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-                    case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
-                }
+    int length = (int)(scanner->current - scanner->start);
+    if (length < 2) return TOKEN_IDENTIFIER;
+
+    const Keyword* keyword = &keywords[KEYWORD_SLOT(scanner->start[0], scanner->start[1], length)];
+    if (keyword->length == length && memcmp(scanner->start, keyword->name, length) == 0) return keyword->type;
+    return TOKEN_IDENTIFIER;
+}
+
+static Token identifier(Scanner* scanner) {
+    // Most identifiers are short, so the first few characters are checked one at a time
+    for (int i = 0; i < 8; i++) {
+        if (!isWordChar(peek(scanner))) return makeToken(scanner, identifierType(scanner));
+        advance(scanner);
+    }
+    for (;;) {
+#ifdef __SSE2__
+        __m128i block;
+        if (loadBlock(scanner->current, &block)) {
+            __m128i lower = _mm_or_si128(block, _mm_set1_epi8(0x20));
+            __m128i word = _mm_or_si128(_mm_or_si128(inRange(lower, 'a', 'z'), inRange(block, '0', '9')),
+                                        _mm_cmpeq_epi8(block, _mm_set1_epi8('_')));
+            unsigned rest = (unsigned)_mm_movemask_epi8(word);
+            if (rest == 0xffff) {
+                scanner->current += BLOCK_SIZE;
+                continue;
             }
+            scanner->current += __builtin_ctz(~rest);
             break;
-        case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-        case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-        case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-        case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-        case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-        case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-        case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+        }
+#endif
+        if (!isWordChar(peek(scanner))) break;
+        advance(scanner);
     }
 
-    return TOKEN_IDENTIFIER;
+    return makeToken(scanner, identifierType(scanner));
 }
 
-static Token identifier() {
-    while (isAlpha(peek()) || isDigit(peek())) advance();
+static Token number(Scanner* scanner) {
+    while (isDigit(peek(scanner)))
+        advance(scanner);
 
-    return makeToken(identifierType());
-}
+    if (peek(scanner) == '.' && isDigit(peekNext(scanner))) {
+        advance(scanner);
+        while (isDigit(peek(scanner)))
+            advance(scanner);
+    }
 
-static Token number() {
-    while (isDigit(peek()))
-        advance();
+    return makeToken(scanner, TOKEN_NUMBER);
+}
 
-    if (peek() == '.' && isDigit(peekNext())) {
-        advance();
-        while (isDigit(peek()))
-            advance();
+// Powers of ten that are exact as doubles
+static const double exactPowers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+double numberValue(const char* start, int length) {
+    // With at most 2^53 as the digits and at most 22 of them after the point, both sides of the division are exact
+    // and the one rounding it does gives the correctly rounded result. Anything else is left to strtod.
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int fraction = -1;
+    for (int i = 0; i < length; i++) {
+        if (start[i] == '.') {
+            fraction = 0;
+            continue;
+        }
+        if (++digits > 19) return strtod(start, NULL);
+        mantissa = mantissa * 10 + (uint64_t)(start[i] - '0');
+        if (fraction >= 0) fraction++;
     }
+    if (fraction < 0) fraction = 0;
 
-    return makeToken(TOKEN_NUMBER);
+    if (mantissa > (UINT64_C(1) << 53) || fraction > 22) return strtod(start, NULL);
+    return (double)mantissa / exactPowers[fraction];
 }
 
-Token scanToken() {
-    skipWhitespace();
-    scanner.start = scanner.current;
+static inline Token nextToken(Scanner* scanner) {
+    skipWhitespace(scanner);
+    scanner->start = scanner->current;
 
-    if (isAtEnd()) return makeToken(TOKEN_EOF);
+    if (isAtEnd(scanner)) return makeToken(scanner, TOKEN_EOF);
 
-    char c = advance();
-    if (isAlpha(c)) return identifier();
+    char c = advance(scanner);
+    if (isAlpha(c)) return identifier(scanner);
 
-    if (isDigit(c)) return number();
+    if (isDigit(c)) return number(scanner);
 
     switch (c) {
-    case '(': return makeToken(TOKEN_LEFT_PAREN);
-    case ')': return makeToken(TOKEN_RIGHT_PAREN);
-    case '{': return makeToken(TOKEN_LEFT_BRACE);
-    case '}': return makeToken(TOKEN_RIGHT_BRACE);
-    case ';': return makeToken(TOKEN_SEMICOLON);
-    case ',': return makeToken(TOKEN_COMMA);
-    case '.': return makeToken(TOKEN_DOT);
-    case '-': return makeToken(TOKEN_MINUS);
-    case '+': return makeToken(TOKEN_PLUS);
-    case '/': return makeToken(TOKEN_SLASH);
-    case '*': return makeToken(TOKEN_STAR);
+    case '(': return makeToken(scanner, TOKEN_LEFT_PAREN);
+    case ')': return makeToken(scanner, TOKEN_RIGHT_PAREN);
+    case '{': return makeToken(scanner, TOKEN_LEFT_BRACE);
+    case '}': return makeToken(scanner, TOKEN_RIGHT_BRACE);
+    case ';': return makeToken(scanner, TOKEN_SEMICOLON);
+    case ',': return makeToken(scanner, TOKEN_COMMA);
+    case '.': return makeToken(scanner, TOKEN_DOT);
+    case '-': return makeToken(scanner, TOKEN_MINUS);
+    case '+': return makeToken(scanner, TOKEN_PLUS);
+    case '/': return makeToken(scanner, TOKEN_SLASH);
+    case '*': return makeToken(scanner, TOKEN_STAR);
+    case '[': return makeToken(scanner, TOKEN_LEFT_BRACKET);
+    case ']': return makeToken(scanner, TOKEN_RIGHT_BRACKET);
+    case ':': return makeToken(scanner, TOKEN_COLON);
     
         // Two char tokens
     case '!':
-        return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+        return makeToken(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
     case '=':
-        return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+        return makeToken(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
     case '<':
-        return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+        return makeToken(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
     case '>':
-        return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+        return makeToken(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+
+    case '"': return string(scanner);
+
+    }
+
+    return errorToken(scanner, "Unexpected character.");
+}
+
+Token scanToken(Scanner* scanner) {
+    return nextToken(scanner);
+}
+
+void initTokenBuffer(TokenBuffer* tokens) {
+    tokens->source = NULL;
+    tokens->count = 0;
+    tokens->capacity = 0;
+    tokens->types = NULL;
+    tokens->offsets = NULL;
+    tokens->lengths = NULL;
+    tokens->errors = NULL;
+    tokens->errorCount = 0;
+    tokens->errorCapacity = 0;
+    tokens->lines = NULL;
+    tokens->lineCount = 0;
+    tokens->lineCapacity = 0;
+    tokens->lineCursor = 0;
+    tokens->complete = false;
+}
+
+void freeTokenBuffer(TokenBuffer* tokens) {
+    FREE_ARRAY(uint8_t, tokens->types, tokens->capacity, MEM_TOKENS);
+    FREE_ARRAY(uint32_t, tokens->offsets, tokens->capacity, MEM_TOKENS);
+    FREE_ARRAY(uint32_t, tokens->lengths, tokens->capacity, MEM_TOKENS);
+    FREE_ARRAY(const char*, tokens->errors, tokens->errorCapacity, MEM_TOKENS);
+    FREE_ARRAY(TokenLine, tokens->lines, tokens->lineCapacity, MEM_TOKENS);
+    initTokenBuffer(tokens);
+}
+
+static void resizeTokenBuffer(TokenBuffer* tokens, int capacity) {
+    int oldCapacity = tokens->capacity;
+    tokens->capacity = capacity;
+    tokens->types = GROW_ARRAY(tokens->types, uint8_t, oldCapacity, capacity, MEM_TOKENS);
+    tokens->offsets = GROW_ARRAY(tokens->offsets, uint32_t, oldCapacity, capacity, MEM_TOKENS);
+    tokens->lengths = GROW_ARRAY(tokens->lengths, uint32_t, oldCapacity, capacity, MEM_TOKENS);
+}
+
+static uint32_t addError(TokenBuffer* tokens, const char* message) {
+    if (tokens->errorCount == tokens->errorCapacity) {
+        int oldCapacity = tokens->errorCapacity;
+        tokens->errorCapacity = GROW_CAPACITY(oldCapacity);
+        tokens->errors = GROW_ARRAY(tokens->errors, const char*, oldCapacity, tokens->errorCapacity, MEM_TOKENS);
+    }
+    tokens->errors[tokens->errorCount] = message;
+    return (uint32_t)tokens->errorCount++;
+}
+
+static void addLine(TokenBuffer* tokens, int token, int line) {
+    if (tokens->lineCount == tokens->lineCapacity) {
+        int oldCapacity = tokens->lineCapacity;
+        tokens->lineCapacity = GROW_CAPACITY(oldCapacity);
+        tokens->lines = GROW_ARRAY(tokens->lines, TokenLine, oldCapacity, tokens->lineCapacity, MEM_TOKENS);
+    }
+    tokens->lines[tokens->lineCount].token = token;
+    tokens->lines[tokens->lineCount].line = line;
+    tokens->lineCount++;
+}
+
+void startTokens(TokenBuffer* tokens, const char* source) {
+    tokens->source = source;
+    tokens->count = 0;
+    tokens->errorCount = 0;
+    tokens->lineCount = 0;
+    tokens->lineCursor = 0;
+    tokens->complete = false;
+    initScanner(&tokens->scanner, source);
+}
 
-    case '"': return string();
+void scanTokenWindow(TokenBuffer* tokens, int keep, int limit) {
+    // The kept tokens start the buffer over, along with the runs giving their lines
+    int dropped = tokens->count - keep;
+    int keptLine = 0;
+    int run = tokens->lineCount;
+    if (keep > 0) {
+        keptLine = tokenLine(tokens, dropped);
+        run = tokens->lineCursor;
+        memmove(tokens->types, tokens->types + dropped, (size_t)keep * sizeof(uint8_t));
+        memmove(tokens->offsets, tokens->offsets + dropped, (size_t)keep * sizeof(uint32_t));
+        memmove(tokens->lengths, tokens->lengths + dropped, (size_t)keep * sizeof(uint32_t));
+    }
+    int kept = 0;
+    for (; run < tokens->lineCount; run++) {
+        TokenLine start = tokens->lines[run];
+        tokens->lines[kept].token = start.token < dropped ? 0 : start.token - dropped;
+        tokens->lines[kept].line = start.token < dropped ? keptLine : start.line;
+        kept++;
+    }
+    tokens->lineCount = kept;
+    tokens->lineCursor = 0;
+    tokens->count = keep;
+
+    if ((size_t)keep + limit > (size_t)tokens->capacity && (size_t)keep + limit < INT32_MAX) {
+        resizeTokenBuffer(tokens, keep + limit);
+    }
 
+    Scanner* scanner = &tokens->scanner;
+    int line = kept > 0 ? tokens->lines[kept - 1].line : 0;
+    for (int scanned = 0; scanned < limit && !tokens->complete; scanned++) {
+        Token token = nextToken(scanner);
+        if (tokens->count == tokens->capacity) resizeTokenBuffer(tokens, GROW_CAPACITY(tokens->capacity));
+
+        int index = tokens->count++;
+        tokens->types[index] = (uint8_t)token.type;
+        tokens->offsets[index] = (uint32_t)(scanner->start - tokens->source);
+        tokens->lengths[index] = token.type == TOKEN_ERROR ? addError(tokens, token.start) : (uint32_t)token.length;
+        if (token.line != line) {
+            addLine(tokens, index, token.line);
+            line = token.line;
+        }
+        tokens->complete = token.type == TOKEN_EOF;
     }
+}
 
-    return errorToken("Unexpected character.");
-}
\ No newline at end of file
+void scanTokens(TokenBuffer* tokens, const char* source) {
+    startTokens(tokens, source);
+    // Roughly one token per four bytes of source, so most scripts never regrow
+    size_t expected = strlen(source) / 4 + 1;
+    scanTokenWindow(tokens, 0, expected < INT32_MAX ? (int)expected : INT32_MAX);
+    while (!tokens->complete) scanTokenWindow(tokens, tokens->count, INT32_MAX - tokens->count);
+}
+
+Token tokenAt(TokenBuffer* tokens, int index) {
+    Token token;
+    token.type = (TokenType)tokens->types[index];
+    if (token.type == TOKEN_ERROR) {
+        token.start = tokens->errors[tokens->lengths[index]];
+        token.length = (int)strlen(token.start);
+    } else {
+        token.start = tokens->source + tokens->offsets[index];
+        token.length = (int)tokens->lengths[index];
+    }
+    token.line = tokenLine(tokens, index);
+    return token;
+}
+
+int findTokenLine(TokenBuffer* tokens, int index) {
+    int run = tokens->lineCursor;
+    if (run + 1 < tokens->lineCount && tokens->lines[run + 1].token <= index &&
+        (run + 2 == tokens->lineCount || tokens->lines[run + 2].token > index)) {
+        // Moved on to the next line
+        run++;
+    } else {
+        // Binary search for the last run that starts at or before index, like getLine()
+        int low = 0;
+        int high = tokens->lineCount - 1;
+        while (low < high) {
+            int mid = low + (high - low + 1) / 2;
+            if (tokens->lines[mid].token <= index) {
+                low = mid;
+            } else {
+                high = mid - 1;
+            }
+        }
+        run = low;
+    }
+    tokens->lineCursor = run;
+    return tokens->lines[run].line;
+}
@@ -1,12 +1,15 @@
 #ifndef scanner_h               
 #define scanner_h               
 
+#include "commons.h"
+
 typedef enum {
     // Single-character tokens.                         
     TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
     TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
     TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
     TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
+    TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET, TOKEN_COLON,
 
     // One or two character tokens.                     
     TOKEN_BANG, TOKEN_BANG_EQUAL,
@@ -21,7 +24,8 @@ typedef enum {
     TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE,
     TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NIL, TOKEN_OR,
     TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS,
-    TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE,
+    TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE, TOKEN_IMPORT,
+    TOKEN_FROM,
 
     TOKEN_ERROR,
     TOKEN_EOF
@@ -32,7 +36,67 @@ typedef struct {
     int length;
     int line;
 } Token;
-void initScanner(const char* source);
-Token scanToken();
+
+typedef struct {
+    const char* start;
+    const char* current;
+    int line;
+} Scanner;
+
+// Start of a run of tokens on the same line
+typedef struct {
+    int token;
+    int line;
+} TokenLine;
+
+// Tokens of a source, scanned a window at a time or all up front into parallel arrays so the parser reads 9 bytes per
+// token. Lexemes are offsets into the source, and lines are stored once per run of tokens rather than per token.
+typedef struct {
+    const char* source;
+    int count;
+    int capacity;
+    uint8_t* types;
+    uint32_t* offsets;
+    // For TOKEN_ERROR this is an index into errors instead
+    uint32_t* lengths;
+
+    const char** errors;
+    int errorCount;
+    int errorCapacity;
+
+    TokenLine* lines;
+    int lineCount;
+    int lineCapacity;
+    // The run the last line lookup landed in, since the parser asks about nearby tokens
+    int lineCursor;
+
+    // Set once the TOKEN_EOF is in the buffer
+    bool complete;
+    // Where scanning picks up for the next window
+    Scanner scanner;
+} TokenBuffer;
+
+void initScanner(Scanner* scanner, const char* source);
+Token scanToken(Scanner* scanner);
+
+void initTokenBuffer(TokenBuffer* tokens);
+void freeTokenBuffer(TokenBuffer* tokens);
+// Scans all of source, which must be shorter than 4 GiB, ending with a TOKEN_EOF
+void scanTokens(TokenBuffer* tokens, const char* source);
+// Scanning a window at a time keeps the buffer small for huge sources. startTokens() empties the buffer, then each
+// scanTokenWindow() moves the last keep tokens to the front and scans up to limit more after them.
+void startTokens(TokenBuffer* tokens, const char* source);
+void scanTokenWindow(TokenBuffer* tokens, int keep, int limit);
+Token tokenAt(TokenBuffer* tokens, int index);
+int findTokenLine(TokenBuffer* tokens, int index);
+
+// The parser asks about the same few tokens over and over, so the run found last time is checked before searching
+static inline int tokenLine(TokenBuffer* tokens, int index) {
+    TokenLine* run = &tokens->lines[tokens->lineCursor];
+    if (run->token <= index && (tokens->lineCursor + 1 == tokens->lineCount || run[1].token > index)) return run->line;
+    return findTokenLine(tokens, index);
+}
+// The value of a TOKEN_NUMBER lexeme
+double numberValue(const char* start, int length);
 
 #endif 
\ No newline at end of file
@@ -0,0 +1,181 @@
+//
+// Bulk kernels over contiguous doubles, picked at startup for the best instruction set the CPU supports.
+//
+// The kernels are written once with GCC vector extensions and instantiated for 128-bit (SSE2) and 256-bit (AVX2)
+// vectors. Reductions keep one partial result per lane, so their rounding can differ from a left-to-right loop.
+//
+
+#include <string.h>
+
+#include "simd.h"
+
+#define SCALAR_BINARY(name, expression) \
+    static void name##Scalar(double *out, const double *a, const double *b, int count) { \
+        for (int i = 0; i < count; i++) { double x = a[i], y = b[i]; out[i] = (expression); } \
+    } \
+    static void name##ScalarBy(double *out, const double *a, double y, int count) { \
+        for (int i = 0; i < count; i++) { double x = a[i]; out[i] = (expression); } \
+    }
+
+SCALAR_BINARY(add, x + y)
+SCALAR_BINARY(subtract, x - y)
+SCALAR_BINARY(multiply, x * y)
+SCALAR_BINARY(divide, x / y)
+SCALAR_BINARY(less, x < y ? 1.0 : 0.0)
+SCALAR_BINARY(greater, x > y ? 1.0 : 0.0)
+SCALAR_BINARY(equal, x == y ? 1.0 : 0.0)
+
+static double sumScalar(const double *a, int count) {
+    double sum = 0;
+    for (int i = 0; i < count; i++) sum += a[i];
+    return sum;
+}
+
+static double minScalar(const double *a, int count) {
+    double min = a[0];
+    for (int i = 1; i < count; i++) if (a[i] < min) min = a[i];
+    return min;
+}
+
+static double maxScalar(const double *a, int count) {
+    double max = a[0];
+    for (int i = 1; i < count; i++) if (a[i] > max) max = a[i];
+    return max;
+}
+
+static double dotScalar(const double *a, const double *b, int count) {
+    double sum = 0;
+    for (int i = 0; i < count; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+static const Kernels scalarKernels = {
+        "scalar",
+        {addScalar, subtractScalar, multiplyScalar, divideScalar, lessScalar, greaterScalar, equalScalar},
+        {addScalarBy, subtractScalarBy, multiplyScalarBy, divideScalarBy, lessScalarBy, greaterScalarBy,
+         equalScalarBy},
+        sumScalar, minScalar, maxScalar, dotScalar
+};
+
+const Kernels *kernels = &scalarKernels;
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define VECTOR_KERNELS
+
+typedef double Double2 __attribute__((vector_size(16)));
+typedef long long Mask2 __attribute__((vector_size(16)));
+typedef double Double4 __attribute__((vector_size(32)));
+typedef long long Mask4 __attribute__((vector_size(32)));
+
+#define LOAD(Vector, pointer) ({ Vector loaded; memcpy(&loaded, (pointer), sizeof(Vector)); loaded; })
+#define STORE(pointer, value) ({ __typeof__(value) stored = (value); memcpy((pointer), &stored, sizeof(stored)); })
+#define LANES(Vector) ((int) (sizeof(Vector) / sizeof(double)))
+
+// Comparison masks are all ones or all zeros per lane, and-ing them with 1.0 gives 1.0 or 0.0
+#define AS_ONE(Vector, Mask, mask) ((Vector) ((Mask) (mask) & (Mask) ((Vector) {} + 1.0)))
+// Lane-wise choice between two vectors
+#define SELECT(Vector, Mask, mask, x, y) ((Vector) (((Mask) (mask) & (Mask) (x)) | (~(Mask) (mask) & (Mask) (y))))
+
+#define VECTOR_BINARY(name, suffix, attributes, Vector, Mask, vectorExpression, scalarExpression) \
+    attributes static void name##suffix(double *out, const double *a, const double *b, int count) { \
+        int i = 0; \
+        for (; i + LANES(Vector) <= count; i += LANES(Vector)) { \
+            Vector x = LOAD(Vector, a + i), y = LOAD(Vector, b + i); \
+            STORE(out + i, (vectorExpression)); \
+        } \
+        for (; i < count; i++) { double x = a[i], y = b[i]; out[i] = (scalarExpression); } \
+    } \
+    attributes static void name##suffix##By(double *out, const double *a, double scalar, int count) { \
+        Vector y = (Vector) {} + scalar; \
+        int i = 0; \
+        for (; i + LANES(Vector) <= count; i += LANES(Vector)) { \
+            Vector x = LOAD(Vector, a + i); \
+            STORE(out + i, (vectorExpression)); \
+        } \
+        for (; i < count; i++) { double x = a[i]; double y = scalar; out[i] = (scalarExpression); } \
+    }
+
+// Four accumulators per kernel hide the latency of the adds
+#define VECTOR_REDUCTIONS(suffix, attributes, Vector, Mask) \
+    attributes static double sum##suffix(const double *a, int count) { \
+        Vector sums[4] = {{0}}; \
+        int i = 0; \
+        for (; i + 4 * LANES(Vector) <= count; i += 4 * LANES(Vector)) { \
+            for (int j = 0; j < 4; j++) sums[j] += LOAD(Vector, a + i + j * LANES(Vector)); \
+        } \
+        Vector total = (sums[0] + sums[1]) + (sums[2] + sums[3]); \
+        double sum = 0; \
+        for (int lane = 0; lane < LANES(Vector); lane++) sum += total[lane]; \
+        for (; i < count; i++) sum += a[i]; \
+        return sum; \
+    } \
+    attributes static double dot##suffix(const double *a, const double *b, int count) { \
+        Vector sums[4] = {{0}}; \
+        int i = 0; \
+        for (; i + 4 * LANES(Vector) <= count; i += 4 * LANES(Vector)) { \
+            for (int j = 0; j < 4; j++) { \
+                sums[j] += LOAD(Vector, a + i + j * LANES(Vector)) * LOAD(Vector, b + i + j * LANES(Vector)); \
+            } \
+        } \
+        Vector total = (sums[0] + sums[1]) + (sums[2] + sums[3]); \
+        double sum = 0; \
+        for (int lane = 0; lane < LANES(Vector); lane++) sum += total[lane]; \
+        for (; i < count; i++) sum += a[i] * b[i]; \
+        return sum; \
+    } \
+    attributes static double min##suffix(const double *a, int count) { \
+        if (count < LANES(Vector)) return minScalar(a, count); \
+        Vector min = LOAD(Vector, a); \
+        int i = LANES(Vector); \
+        for (; i + LANES(Vector) <= count; i += LANES(Vector)) { \
+            Vector x = LOAD(Vector, a + i); \
+            min = SELECT(Vector, Mask, x < min, x, min); \
+        } \
+        double result = min[0]; \
+        for (int lane = 1; lane < LANES(Vector); lane++) if (min[lane] < result) result = min[lane]; \
+        for (; i < count; i++) if (a[i] < result) result = a[i]; \
+        return result; \
+    } \
+    attributes static double max##suffix(const double *a, int count) { \
+        if (count < LANES(Vector)) return maxScalar(a, count); \
+        Vector max = LOAD(Vector, a); \
+        int i = LANES(Vector); \
+        for (; i + LANES(Vector) <= count; i += LANES(Vector)) { \
+            Vector x = LOAD(Vector, a + i); \
+            max = SELECT(Vector, Mask, x > max, x, max); \
+        } \
+        double result = max[0]; \
+        for (int lane = 1; lane < LANES(Vector); lane++) if (max[lane] > result) result = max[lane]; \
+        for (; i < count; i++) if (a[i] > result) result = a[i]; \
+        return result; \
+    }
+
+#define VECTOR_KERNEL_SET(suffix, attributes, Vector, Mask) \
+    VECTOR_BINARY(add, suffix, attributes, Vector, Mask, x + y, x + y) \
+    VECTOR_BINARY(subtract, suffix, attributes, Vector, Mask, x - y, x - y) \
+    VECTOR_BINARY(multiply, suffix, attributes, Vector, Mask, x * y, x * y) \
+    VECTOR_BINARY(divide, suffix, attributes, Vector, Mask, x / y, x / y) \
+    VECTOR_BINARY(less, suffix, attributes, Vector, Mask, AS_ONE(Vector, Mask, x < y), x < y ? 1.0 : 0.0) \
+    VECTOR_BINARY(greater, suffix, attributes, Vector, Mask, AS_ONE(Vector, Mask, x > y), x > y ? 1.0 : 0.0) \
+    VECTOR_BINARY(equal, suffix, attributes, Vector, Mask, AS_ONE(Vector, Mask, x == y), x == y ? 1.0 : 0.0) \
+    VECTOR_REDUCTIONS(suffix, attributes, Vector, Mask) \
+    static const Kernels suffix##Kernels = { \
+        #suffix, \
+        {add##suffix, subtract##suffix, multiply##suffix, divide##suffix, less##suffix, greater##suffix, \
+         equal##suffix}, \
+        {add##suffix##By, subtract##suffix##By, multiply##suffix##By, divide##suffix##By, less##suffix##By, \
+         greater##suffix##By, equal##suffix##By}, \
+        sum##suffix, min##suffix, max##suffix, dot##suffix \
+    };
+
+// SSE2 is part of x86-64, so these need no check
+VECTOR_KERNEL_SET(Sse2, , Double2, Mask2)
+VECTOR_KERNEL_SET(Avx2, __attribute__((target("avx2"))), Double4, Mask4)
+#endif
+
+void initKernels() {
+#ifdef VECTOR_KERNELS
+    __builtin_cpu_init();
+    kernels = __builtin_cpu_supports("avx2") ? &Avx2Kernels : &Sse2Kernels;
+#endif
+}
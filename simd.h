@@ -0,0 +1,43 @@
+//
+// Bulk kernels over contiguous doubles, picked at startup for the best instruction set the CPU supports.
+//
+
+#ifndef YAVM_SIMD_H
+#define YAVM_SIMD_H
+
+#include "commons.h"
+
+typedef enum {
+    KERNEL_ADD,
+    KERNEL_SUBTRACT,
+    KERNEL_MULTIPLY,
+    KERNEL_DIVIDE,
+    // 1.0 where the comparison holds, 0.0 elsewhere
+    KERNEL_LESS,
+    KERNEL_GREATER,
+    KERNEL_EQUAL,
+
+    KERNEL_OP_COUNT
+} KernelOp;
+
+typedef void (*BinaryKernel)(double* out, const double* a, const double* b, int count);
+// b is a single value applied to every element of a
+typedef void (*ScalarKernel)(double* out, const double* a, double b, int count);
+typedef double (*ReduceKernel)(const double* a, int count);
+
+typedef struct {
+    const char* name;
+    BinaryKernel binary[KERNEL_OP_COUNT];
+    ScalarKernel scalar[KERNEL_OP_COUNT];
+    ReduceKernel sum;
+    ReduceKernel min;
+    ReduceKernel max;
+    double (*dot)(const double* a, const double* b, int count);
+} Kernels;
+
+// Set by initKernels(), scalar code until then
+extern const Kernels* kernels;
+
+void initKernels();
+
+#endif //YAVM_SIMD_H
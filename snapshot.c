@@ -0,0 +1,546 @@
+//
+// Heap images, see snapshot.h
+//
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "memory.h"
+#include "object.h"
+#include "snapshot.h"
+#include "table.h"
+#include "vm.h"
+
+#define SNAPSHOT_MAGIC "YVMS"
+// Written as a number, so an image from a machine of the other byte order reads back differently
+#define BYTE_ORDER_MARK 0x01020304u
+
+#define SECTION_ALIGNMENT 8
+#define ALIGN_SECTION(size) (((size) + SECTION_ALIGNMENT - 1) & ~(uint64_t) (SECTION_ALIGNMENT - 1))
+
+#define RECORD_INTERNED 0x1
+
+typedef struct {
+    char magic[4];
+    uint32_t byteOrder;
+    uint32_t version;
+    uint32_t objectCount;
+    uint64_t fingerprint;
+    // Of everything after the header
+    uint64_t checksum;
+    // The globals come first, then the entries of each map one after another
+    uint32_t entryCount;
+    uint32_t globalCount;
+    uint64_t dataBytes;
+} SnapshotHeader;
+
+typedef struct {
+    uint32_t type;
+    uint32_t flags;
+    // Characters of a string, numbers of an array, entries of a map
+    uint32_t length;
+    uint32_t unused;
+    // Into the data section for strings and arrays, into the entries for maps. Strings are followed by a '\0'.
+    uint64_t offset;
+} ObjectRecord;
+
+typedef struct {
+    uint32_t type;
+    // Index of the object, or the boolean
+    uint32_t object;
+    double number;
+} ValueRecord;
+
+typedef struct {
+    // Index of an interned string
+    uint32_t key;
+    uint32_t unused;
+    ValueRecord value;
+} EntryRecord;
+
+// Offsets of the sections from the start of the file, and the size of the whole file
+typedef struct {
+    uint64_t objects;
+    uint64_t entries;
+    uint64_t data;
+    uint64_t end;
+} Layout;
+
+static Layout layoutOf(const SnapshotHeader* header) {
+    Layout layout;
+    layout.objects = ALIGN_SECTION(sizeof(SnapshotHeader));
+    layout.entries = layout.objects + ALIGN_SECTION((uint64_t) header->objectCount * sizeof(ObjectRecord));
+    layout.data = layout.entries + ALIGN_SECTION((uint64_t) header->entryCount * sizeof(EntryRecord));
+    layout.end = layout.data + ALIGN_SECTION(header->dataBytes);
+    return layout;
+}
+
+static uint64_t checksumOf(const char* file, uint64_t size) {
+    return hashWyMix(file + sizeof(SnapshotHeader), (size_t) (size - sizeof(SnapshotHeader)), 0);
+}
+
+// The objects to write in the order they are numbered, with a table from each object to its number
+typedef struct {
+    Obj* object;
+    uint32_t index;
+} ObjectSlot;
+
+typedef struct {
+    Obj** objects;
+    uint32_t count;
+    uint32_t capacity;
+    // Open addressing with linear probing, a power of two in size
+    ObjectSlot* slots;
+    uint32_t slotCapacity;
+    // SNAPSHOT_OK until an object cannot be numbered
+    SnapshotStatus status;
+} ObjectIndex;
+
+static uint32_t hashObject(Obj* object) {
+    // The finalizer of MurmurHash3, allocations are aligned so the low bits of the address are all the same
+    uint64_t bits = (uint64_t) (uintptr_t) object;
+    bits ^= bits >> 33;
+    bits *= UINT64_C(0xff51afd7ed558ccd);
+    bits ^= bits >> 33;
+    return (uint32_t) bits;
+}
+
+static ObjectSlot* findObject(ObjectIndex* index, Obj* object) {
+    uint32_t mask = index->slotCapacity - 1;
+    for (uint32_t slot = hashObject(object) & mask;; slot = (slot + 1) & mask) {
+        if (index->slots[slot].object == NULL || index->slots[slot].object == object) return &index->slots[slot];
+    }
+}
+
+static bool growIndex(ObjectIndex* index) {
+    uint32_t capacity = index->capacity == 0 ? 64 : index->capacity * 2;
+    Obj** objects = realloc(index->objects, sizeof(Obj*) * capacity);
+    if (objects == NULL) return false;
+    index->objects = objects;
+    index->capacity = capacity;
+
+    ObjectSlot* old = index->slots;
+    uint32_t oldCapacity = index->slotCapacity;
+    // Twice the objects, so the load stays under 1/2
+    index->slotCapacity = capacity * 2;
+    index->slots = calloc(index->slotCapacity, sizeof(ObjectSlot));
+    if (index->slots == NULL) {
+        index->slots = old;
+        index->slotCapacity = oldCapacity;
+        return false;
+    }
+    for (uint32_t i = 0; i < oldCapacity; i++) {
+        if (old[i].object != NULL) *findObject(index, old[i].object) = old[i];
+    }
+    free(old);
+    return true;
+}
+
+// Numbers the object if it has no number yet
+static uint32_t indexObject(ObjectIndex* index, Obj* object) {
+    // Imports refer to modules by the file they load from, which an image does not hold
+    if (object->type == OBJ_MODULE || object->type == OBJ_IMPORT) {
+        index->status = SNAPSHOT_HOLDS_MODULE;
+        return 0;
+    }
+    if (index->slotCapacity > 0) {
+        ObjectSlot* slot = findObject(index, object);
+        if (slot->object != NULL) return slot->index;
+    }
+    if (index->count == UINT32_MAX || (index->count == index->capacity && !growIndex(index))) {
+        index->status = SNAPSHOT_TOO_LARGE;
+        return 0;
+    }
+    ObjectSlot* slot = findObject(index, object);
+    slot->object = object;
+    slot->index = index->count;
+    index->objects[index->count] = object;
+    return index->count++;
+}
+
+static void indexTable(ObjectIndex* index, Table* table) {
+    int cursor = 0;
+    for (Entry* entry = tableIterate(table, &cursor); entry != NULL; entry = tableIterate(table, &cursor)) {
+        indexObject(index, (Obj*) entry->key);
+        if (IS_OBJ(entry->value)) indexObject(index, AS_OBJ(entry->value));
+    }
+}
+
+static ValueRecord recordValue(ObjectIndex* index, Value value) {
+    ValueRecord record;
+    record.type = (uint32_t) value.type;
+    record.object = 0;
+    record.number = 0;
+    switch (value.type) {
+        case VAL_BOOL: record.object = AS_BOOL(value); break;
+        case VAL_NIL: break;
+        case VAL_NUMBER: record.number = AS_NUMBER(value); break;
+        case VAL_OBJ: record.object = indexObject(index, AS_OBJ(value)); break;
+    }
+    return record;
+}
+
+static EntryRecord* recordTable(ObjectIndex* index, Table* table, EntryRecord* entries) {
+    int cursor = 0;
+    for (Entry* entry = tableIterate(table, &cursor); entry != NULL; entry = tableIterate(table, &cursor)) {
+        entries->key = indexObject(index, (Obj*) entry->key);
+        entries->unused = 0;
+        entries->value = recordValue(index, entry->value);
+        entries++;
+    }
+    return entries;
+}
+
+SnapshotStatus writeSnapshot(const char* path, uint64_t fingerprint) {
+    // Interned strings first, then everything reachable from the globals. Maps are numbered as they are reached, so
+    // walking the numbered objects in order reaches the contents of every map.
+    ObjectIndex index = {NULL, 0, 0, NULL, 0, SNAPSHOT_OK};
+    indexTable(&index, &vm->strings);
+    indexTable(&index, &vm->globals);
+    uint64_t entryCount = (uint64_t) vm->globals.count;
+    for (uint32_t i = 0; i < index.count && index.status == SNAPSHOT_OK; i++) {
+        if (index.objects[i]->type != OBJ_MAP) continue;
+        Table* table = &((ObjMap*) index.objects[i])->table;
+        indexTable(&index, table);
+        entryCount += (uint64_t) table->count;
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.byteOrder = BYTE_ORDER_MARK;
+    header.version = SNAPSHOT_VERSION;
+    header.objectCount = index.count;
+    header.fingerprint = fingerprint;
+    header.globalCount = (uint32_t) vm->globals.count;
+
+    // Arrays go first so their numbers stay aligned
+    uint64_t dataBytes = 0;
+    for (uint32_t i = 0; i < index.count; i++) {
+        Obj* object = index.objects[i];
+        if (object->type == OBJ_F64ARRAY) dataBytes += (uint64_t) ((ObjF64Array*) object)->length * sizeof(double);
+    }
+    uint64_t stringStart = dataBytes;
+    for (uint32_t i = 0; i < index.count; i++) {
+        Obj* object = index.objects[i];
+        if (object->type == OBJ_STRING) dataBytes += (uint64_t) ((ObjString*) object)->length + 1;
+    }
+    header.dataBytes = dataBytes;
+
+    char* file = NULL;
+    SnapshotStatus status = index.status;
+    if (status == SNAPSHOT_OK && entryCount > UINT32_MAX) status = SNAPSHOT_TOO_LARGE;
+    if (status == SNAPSHOT_OK) {
+        header.entryCount = (uint32_t) entryCount;
+        Layout layout = layoutOf(&header);
+        file = calloc(1, (size_t) layout.end);
+        if (file == NULL) {
+            status = SNAPSHOT_TOO_LARGE;
+        } else {
+            ObjectRecord* records = (ObjectRecord*) (file + layout.objects);
+            EntryRecord* entries = recordTable(&index, &vm->globals, (EntryRecord*) (file + layout.entries));
+            char* data = file + layout.data;
+            uint64_t arrayOffset = 0;
+            uint64_t stringOffset = stringStart;
+            for (uint32_t i = 0; i < index.count; i++) {
+                Obj* object = index.objects[i];
+                ObjectRecord* record = &records[i];
+                record->type = (uint32_t) object->type;
+                switch (object->type) {
+                    case OBJ_STRING: {
+                        ObjString* string = (ObjString*) object;
+                        record->flags = string->interned ? RECORD_INTERNED : 0;
+                        record->length = (uint32_t) string->length;
+                        record->offset = stringOffset;
+                        memcpy(data + stringOffset, string->chars, (size_t) string->length);
+                        stringOffset += (uint64_t) string->length + 1;
+                        break;
+                    }
+                    case OBJ_MAP: {
+                        ObjMap* map = (ObjMap*) object;
+                        record->length = (uint32_t) map->table.count;
+                        record->offset = (uint64_t) (entries - (EntryRecord*) (file + layout.entries));
+                        entries = recordTable(&index, &map->table, entries);
+                        break;
+                    }
+                    case OBJ_F64ARRAY: {
+                        ObjF64Array* array = (ObjF64Array*) object;
+                        record->length = (uint32_t) array->length;
+                        record->offset = arrayOffset;
+                        if (array->length > 0) {
+                            memcpy(data + arrayOffset, array->values, sizeof(double) * (size_t) array->length);
+                        }
+                        arrayOffset += (uint64_t) array->length * sizeof(double);
+                        break;
+                    }
+                    case OBJ_MODULE:
+                    case OBJ_IMPORT:
+                        // Never numbered
+                        break;
+                }
+            }
+            header.checksum = checksumOf(file, layout.end);
+            memcpy(file, &header, sizeof(header));
+            if (!replaceFile(path, file, (size_t) layout.end)) status = SNAPSHOT_UNWRITABLE;
+        }
+    }
+
+    free(file);
+    free(index.objects);
+    free(index.slots);
+    return status;
+}
+
+// A mapped image whose header, sizes and references have all been checked
+typedef struct {
+    MappedFile* mapping;
+    const SnapshotHeader* header;
+    const ObjectRecord* objects;
+    const EntryRecord* entries;
+    const char* data;
+    uint32_t internedCount;
+} Image;
+
+static bool validValue(const Image* image, const ValueRecord* value) {
+    switch (value->type) {
+        case VAL_BOOL: return value->object <= 1;
+        case VAL_NIL:
+        case VAL_NUMBER: return true;
+        case VAL_OBJ: return value->object < image->header->objectCount;
+    }
+    return false;
+}
+
+static bool validEntry(const Image* image, const EntryRecord* entry) {
+    if (entry->key >= image->header->objectCount) return false;
+    const ObjectRecord* key = &image->objects[entry->key];
+    return key->type == OBJ_STRING && (key->flags & RECORD_INTERNED) && validValue(image, &entry->value);
+}
+
+static bool validObject(Image* image, const ObjectRecord* record) {
+    uint64_t dataBytes = image->header->dataBytes;
+    switch (record->type) {
+        case OBJ_STRING:
+            if (record->length > INT_MAX || record->offset >= dataBytes ||
+                record->length >= dataBytes - record->offset || image->data[record->offset + record->length] != '\0') {
+                return false;
+            }
+            if (record->flags & RECORD_INTERNED) image->internedCount++;
+            return true;
+        case OBJ_MAP:
+            return record->length <= INT_MAX && record->offset <= image->header->entryCount &&
+                   record->length <= image->header->entryCount - record->offset;
+        case OBJ_F64ARRAY:
+            return record->length <= ARRAY_MAX_LENGTH && record->offset % sizeof(double) == 0 && record->offset <= dataBytes &&
+                   (uint64_t) record->length * sizeof(double) <= dataBytes - record->offset;
+    }
+    return false;
+}
+
+static SnapshotStatus openImage(const char* path, const uint64_t* fingerprint, Image* image) {
+    MappedFile* mapping = mapFile(path);
+    if (mapping == NULL) return SNAPSHOT_UNREADABLE;
+
+    const char* file = mapping->data;
+    const SnapshotHeader* header = (const SnapshotHeader*) file;
+    SnapshotStatus status = SNAPSHOT_OK;
+    if (mapping->size < sizeof(SnapshotHeader) || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->byteOrder != BYTE_ORDER_MARK) {
+        status = SNAPSHOT_INVALID;
+    } else if (header->version != SNAPSHOT_VERSION) {
+        status = SNAPSHOT_WRONG_VERSION;
+    } else if (fingerprint != NULL && header->fingerprint != *fingerprint) {
+        status = SNAPSHOT_STALE;
+    } else if (header->dataBytes > UINT64_MAX / 2 || layoutOf(header).end != mapping->size ||
+               header->globalCount > header->entryCount || checksumOf(file, mapping->size) != header->checksum) {
+        status = SNAPSHOT_INVALID;
+    }
+
+    if (status == SNAPSHOT_OK) {
+        Layout layout = layoutOf(header);
+        image->mapping = mapping;
+        image->header = header;
+        image->objects = (const ObjectRecord*) (file + layout.objects);
+        image->entries = (const EntryRecord*) (file + layout.entries);
+        image->data = file + layout.data;
+        image->internedCount = 0;
+        for (uint32_t i = 0; i < header->objectCount && status == SNAPSHOT_OK; i++) {
+            if (!validObject(image, &image->objects[i])) status = SNAPSHOT_INVALID;
+        }
+        for (uint32_t i = 0; i < header->entryCount && status == SNAPSHOT_OK; i++) {
+            if (!validEntry(image, &image->entries[i])) status = SNAPSHOT_INVALID;
+        }
+    }
+    if (status != SNAPSHOT_OK) unmapFile(mapping);
+    return status;
+}
+
+static Value loadValue(const ValueRecord* record, Obj** objects) {
+    switch (record->type) {
+        case VAL_BOOL: return BOOL_VAL(record->object != 0);
+        case VAL_NUMBER: return NUMBER_VAL(record->number);
+        case VAL_OBJ: return OBJ_VAL(objects[record->object]);
+        default: return NIL_VAL;
+    }
+}
+
+static void loadEntries(Table* table, const EntryRecord* entries, uint32_t count, Obj** objects) {
+    for (uint32_t i = 0; i < count; i++) {
+        tableSet(table, (ObjString*) objects[entries[i].key], loadValue(&entries[i].value, objects));
+    }
+}
+
+SnapshotStatus loadSnapshot(const char* path) {
+    Image image;
+    SnapshotStatus status = openImage(path, NULL, &image);
+    if (status != SNAPSHOT_OK) return status;
+
+    const SnapshotHeader* header = image.header;
+    Obj** objects = malloc(sizeof(Obj*) * (header->objectCount > 0 ? header->objectCount : 1));
+    if (objects == NULL) {
+        unmapFile(image.mapping);
+        return SNAPSHOT_UNREADABLE;
+    }
+
+    // Tables drop entries once they cannot grow, which is only noticed through limitHit
+    vm->limitHit = LIMIT_NONE;
+    // Every object is made before any map is filled, so maps can refer to each other in any order
+    tableReserve(&vm->strings, vm->strings.count + (int) image.internedCount);
+    for (uint32_t i = 0; i < header->objectCount; i++) {
+        const ObjectRecord* record = &image.objects[i];
+        switch (record->type) {
+            case OBJ_STRING: {
+                ObjString* string = externalString(image.data + record->offset, (int) record->length);
+                // A string the VM already holds is used instead, so keys stay unique
+                if (record->flags & RECORD_INTERNED) string = internString(string);
+                objects[i] = (Obj*) string;
+                break;
+            }
+            case OBJ_MAP:
+                objects[i] = (Obj*) newMap((int) record->length);
+                break;
+            case OBJ_F64ARRAY: {
+                ObjF64Array* array = newArray((int) record->length);
+                if (array != NULL && record->length > 0) {
+                    memcpy(array->values, image.data + record->offset, sizeof(double) * record->length);
+                }
+                objects[i] = (Obj*) array;
+                break;
+            }
+        }
+    }
+    // Maps and arrays past the heap limit were not made, so nothing may refer to the objects yet
+    if (vm->limitHit != LIMIT_NONE) {
+        free(objects);
+        return SNAPSHOT_OUT_OF_MEMORY;
+    }
+    for (uint32_t i = 0; i < header->objectCount; i++) {
+        const ObjectRecord* record = &image.objects[i];
+        if (record->type != OBJ_MAP) continue;
+        loadEntries(&((ObjMap*) objects[i])->table, image.entries + record->offset, record->length, objects);
+    }
+    tableReserve(&vm->globals, vm->globals.count + (int) header->globalCount);
+    loadEntries(&vm->globals, image.entries, header->globalCount, objects);
+
+    free(objects);
+    return vm->limitHit == LIMIT_NONE ? SNAPSHOT_OK : SNAPSHOT_OUT_OF_MEMORY;
+}
+
+// Pairs the image's objects with the VM's, so shared and cyclic references have to match as well
+typedef struct {
+    const Image* image;
+    Obj** matched;
+} Verifier;
+
+static bool sameObject(Verifier* verifier, uint32_t index, Obj* object);
+
+static bool sameValue(Verifier* verifier, const ValueRecord* record, Value value) {
+    if (record->type != (uint32_t) value.type) return false;
+    switch (value.type) {
+        case VAL_BOOL: return (record->object != 0) == AS_BOOL(value);
+        case VAL_NIL: return true;
+        // Bit for bit, so NaNs match and 0 does not match -0
+        case VAL_NUMBER: return memcmp(&record->number, &value.as.number, sizeof(double)) == 0;
+        case VAL_OBJ: return sameObject(verifier, record->object, AS_OBJ(value));
+    }
+    return false;
+}
+
+static bool sameEntries(Verifier* verifier, Table* table, const EntryRecord* entries, uint32_t count) {
+    if ((uint32_t) table->count != count) return false;
+    for (uint32_t i = 0; i < count; i++) {
+        const ObjectRecord* keyRecord = &verifier->image->objects[entries[i].key];
+        ObjString* key = copyString(verifier->image->data + keyRecord->offset, (int) keyRecord->length);
+        Value value;
+        if (!sameObject(verifier, entries[i].key, (Obj*) key) || !tableGet(table, key, &value) ||
+            !sameValue(verifier, &entries[i].value, value)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool sameObject(Verifier* verifier, uint32_t index, Obj* object) {
+    if (verifier->matched[index] != NULL) return verifier->matched[index] == object;
+    const ObjectRecord* record = &verifier->image->objects[index];
+    if (record->type != (uint32_t) object->type) return false;
+    verifier->matched[index] = object;
+
+    switch (object->type) {
+        case OBJ_STRING: {
+            ObjString* string = (ObjString*) object;
+            return record->length == (uint32_t) string->length &&
+                   memcmp(verifier->image->data + record->offset, string->chars, record->length) == 0;
+        }
+        case OBJ_MAP:
+            return sameEntries(verifier, &((ObjMap*) object)->table, verifier->image->entries + record->offset,
+                               record->length);
+        case OBJ_F64ARRAY: {
+            ObjF64Array* array = (ObjF64Array*) object;
+            return record->length == (uint32_t) array->length &&
+                   memcmp(verifier->image->data + record->offset, array->values,
+                          sizeof(double) * record->length) == 0;
+        }
+        case OBJ_MODULE:
+        case OBJ_IMPORT:
+            return false;
+    }
+    return false;
+}
+
+SnapshotStatus verifySnapshot(const char* path, uint64_t fingerprint) {
+    Image image;
+    SnapshotStatus status = openImage(path, &fingerprint, &image);
+    if (status != SNAPSHOT_OK) return status;
+
+    Verifier verifier;
+    verifier.image = &image;
+    verifier.matched = calloc(image.header->objectCount > 0 ? image.header->objectCount : 1, sizeof(Obj*));
+    if (verifier.matched == NULL) {
+        status = SNAPSHOT_UNREADABLE;
+    } else if (!sameEntries(&verifier, &vm->globals, image.entries, image.header->globalCount)) {
+        status = SNAPSHOT_MISMATCH;
+    }
+    free(verifier.matched);
+    unmapFile(image.mapping);
+    return status;
+}
+
+const char* snapshotStatusMessage(SnapshotStatus status) {
+    switch (status) {
+        case SNAPSHOT_OK: return "ok";
+        case SNAPSHOT_UNREADABLE: return "could not be read";
+        case SNAPSHOT_INVALID: return "is not a snapshot or is damaged";
+        case SNAPSHOT_WRONG_VERSION: return "was written by a different version";
+        case SNAPSHOT_STALE: return "was taken from a different source";
+        case SNAPSHOT_MISMATCH: return "does not match the globals its source defines";
+        case SNAPSHOT_OUT_OF_MEMORY: return "does not fit in the memory the VM may use";
+        case SNAPSHOT_HOLDS_MODULE: return "cannot be taken while a global holds a module or an unread import";
+        case SNAPSHOT_TOO_LARGE: return "would be too large";
+        case SNAPSHOT_UNWRITABLE: return "could not be written";
+    }
+    return "unknown status";
+}
@@ -0,0 +1,54 @@
+//
+// Images of the VM's heap, stored in .yvms files.
+//
+// An image holds every global, every interned string and every object reachable from them, so a process can load the
+// state an initialization script built up instead of running the script again. Objects refer to each other by index
+// rather than by address. String characters are used in place from the mapped image. The headers, the maps and the
+// arrays are built on load, because table layouts depend on the hash seed of the process and arrays can be written to.
+//
+
+#ifndef YAVM_SNAPSHOT_H
+#define YAVM_SNAPSHOT_H
+
+#include "commons.h"
+
+// Bumped whenever the layout changes, images of other versions are refused
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_EXTENSION ".yvms"
+
+typedef enum {
+    SNAPSHOT_OK,
+    SNAPSHOT_UNREADABLE,
+    // Not an image, or damaged
+    SNAPSHOT_INVALID,
+    SNAPSHOT_WRONG_VERSION,
+    // Taken after running a different source than the one asked for
+    SNAPSHOT_STALE,
+    // The VM's globals differ from the image's
+    SNAPSHOT_MISMATCH,
+    // Loading went past the heap limit or out of memory, possibly after defining some of the globals
+    SNAPSHOT_OUT_OF_MEMORY,
+    // The rest only come from writeSnapshot(). A global holds a module, or an import that was never read, which an
+    // image cannot hold.
+    SNAPSHOT_HOLDS_MODULE,
+    // More objects or entries than the format counts, or no memory to build the image in
+    SNAPSHOT_TOO_LARGE,
+    SNAPSHOT_UNWRITABLE
+} SnapshotStatus;
+
+// Writes an image of the VM's globals and interned strings to path, recording the fingerprint of the source that
+// built them (see sourceFingerprint()). Written with replaceFile().
+SnapshotStatus writeSnapshot(const char* path, uint64_t fingerprint);
+
+// Adds the image's strings and objects to the VM and defines its globals, replacing globals of the same name. The
+// image stays mapped until the VM is freed. Nothing is added unless the whole image is valid, but an image that does
+// not fit under the heap limit can be left partly loaded.
+SnapshotStatus loadSnapshot(const char* path);
+
+// Checks that the image at path was taken after running the source with this fingerprint, and that the VM's globals,
+// which the caller has just built by running that source, have the same values and shape as the image's.
+SnapshotStatus verifySnapshot(const char* path, uint64_t fingerprint);
+
+const char* snapshotStatusMessage(SnapshotStatus status);
+
+#endif //YAVM_SNAPSHOT_H
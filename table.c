@@ -2,141 +2,474 @@
 // Created by malal on 3/20/2020.
 //
 
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "hash.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef DEBUG_TABLE_STATS
+#include <time.h>
+
+// Groups visited by the lookup in progress
+static _Thread_local int probedGroups;
+
+static uint64_t nanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+static void recordProbe(size_t *histogram) {
+    histogram[probedGroups < TABLE_PROBE_BUCKETS ? probedGroups : TABLE_PROBE_BUCKETS - 1]++;
+}
+
+#define START_PROBE() (probedGroups = 0)
+#define COUNT_GROUP() (probedGroups++)
+#define RECORD_PROBE(table, histogram) recordProbe((table)->stats.histogram)
+#define START_TIMER() uint64_t timerStart = nanoseconds()
+#define RECORD_TIME(table) ((table)->stats.resizeNanos += nanoseconds() - timerStart)
+#else
+#define START_PROBE()
+#define COUNT_GROUP()
+#define RECORD_PROBE(table, histogram)
+#define START_TIMER()
+#define RECORD_TIME(table)
+#endif
+
+// Live entries plus tombstones may fill 7/8 of the slots, so every probe sequence reaches an empty slot
+#define TABLE_MAX_LOAD_NUMERATOR 7
+#define TABLE_MAX_LOAD_DENOMINATOR 8
+
+// Groups moved out of the old arrays by each operation while resizing. A resize never more than doubles the live
+// entries' share of the new arrays, so migration always finishes before they fill up.
+#define TABLE_MIGRATE_GROUPS 4
+
+#define CONTROL_EMPTY   ((uint8_t) 0x80)
+#define CONTROL_DELETED ((uint8_t) 0xfe)
+
+// The high bits of the hash pick the first group, the low 7 bits are stored in the control byte
+#define HASH_GROUP(hash) ((hash) >> 7)
+#define HASH_TAG(hash)   ((uint8_t) ((hash) & 0x7f))
+
+// One bit per slot of a group
+typedef uint32_t GroupMask;
+
+static GroupMask matchTag(const uint8_t *group, uint8_t tag) {
+#ifdef __SSE2__
+    __m128i control = _mm_loadu_si128((const __m128i *) group);
+    return (GroupMask) _mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char) tag)));
+#else
+    GroupMask mask = 0;
+    for (int i = 0; i < TABLE_GROUP_SIZE; i++) {
+        if (group[i] == tag) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+static GroupMask matchEmpty(const uint8_t *group) {
+    return matchTag(group, CONTROL_EMPTY);
+}
+
+// Empty and deleted are the only control bytes with the high bit set
+static GroupMask matchEmptyOrDeleted(const uint8_t *group) {
+#ifdef __SSE2__
+    return (GroupMask) _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) group));
+#else
+    GroupMask mask = 0;
+    for (int i = 0; i < TABLE_GROUP_SIZE; i++) {
+        if (group[i] & 0x80) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+static int lowestSlot(GroupMask mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(mask);
+#else
+    int slot = 0;
+    while ((mask & 1) == 0) {
+        mask >>= 1;
+        slot++;
+    }
+    return slot;
+#endif
+}
+
+static bool isFull(uint8_t control) {
+    return (control & 0x80) == 0;
+}
 
 void initTable(Table *table) {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
+    table->control = NULL;
     table->entries = NULL;
+
+    table->oldCapacity = 0;
+    table->oldCount = 0;
+    table->migratedGroups = 0;
+    table->oldControl = NULL;
+    table->oldEntries = NULL;
+
+#ifdef DEBUG_TABLE_STATS
+    memset(&table->stats, 0, sizeof(table->stats));
+#endif
+}
+
+static void freeOldArrays(Table *table) {
+    FREE_ARRAY(uint8_t, table->oldControl, table->oldCapacity, MEM_TABLE_ENTRIES);
+    FREE_ARRAY(Entry, table->oldEntries, table->oldCapacity, MEM_TABLE_ENTRIES);
+    table->oldCapacity = 0;
+    table->oldCount = 0;
+    table->migratedGroups = 0;
+    table->oldControl = NULL;
+    table->oldEntries = NULL;
 }
 
 void freeTable(Table *table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    freeOldArrays(table);
+    FREE_ARRAY(uint8_t, table->control, table->capacity, MEM_TABLE_ENTRIES);
+    FREE_ARRAY(Entry, table->entries, table->capacity, MEM_TABLE_ENTRIES);
     initTable(table);
 }
 
-static Entry *findEntry(Entry *entries, int capacity,
-                        ObjString *key) {
-    uint32_t index = key->hash % capacity;
-    Entry *tombstone = NULL;
-
-    while (1) {
-        Entry *entry = &entries[index];
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                // Empty entry.
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                // We found a tombstone.
-                if (tombstone == NULL) tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            // We found the key.
-            return entry;
+// Groups are visited in triangular order, which reaches every group when their count is a power of two
+#define FOR_EACH_GROUP(capacity, hash, group) \
+    for (uint32_t group##Mask = (uint32_t) (capacity) / TABLE_GROUP_SIZE - 1, \
+                  group = HASH_GROUP(hash) & group##Mask, group##Step = 0; ; \
+         group = (group + ++group##Step) & group##Mask)
+
+// Slot holding key in the given arrays, or -1
+static int findSlot(const uint8_t *control, Entry *entries, int capacity, ObjString *key) {
+    if (capacity == 0) return -1;
+    uint8_t tag = HASH_TAG(key->hash);
+
+    FOR_EACH_GROUP(capacity, key->hash, group) {
+        const uint8_t *groupControl = &control[group * TABLE_GROUP_SIZE];
+        COUNT_GROUP();
+
+        for (GroupMask mask = matchTag(groupControl, tag); mask != 0; mask &= mask - 1) {
+            int slot = (int) group * TABLE_GROUP_SIZE + lowestSlot(mask);
+            if (entries[slot].key == key) return slot;
         }
-        index = (index + 1) % capacity;
+        // A key is never placed past a group that still has room
+        if (matchEmpty(groupControl) != 0) return -1;
     }
 }
 
-static void adjustCapacity(Table *table, int capacity) {
-    Entry *entries = ALLOCATE(Entry, capacity);
-    for (int i = 0; i < capacity; i++) {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
+// First empty or deleted slot along the probe sequence of hash
+static int findFreeSlot(const uint8_t *control, int capacity, uint32_t hash) {
+    FOR_EACH_GROUP(capacity, hash, group) {
+        GroupMask mask = matchEmptyOrDeleted(&control[group * TABLE_GROUP_SIZE]);
+        if (mask != 0) return (int) group * TABLE_GROUP_SIZE + lowestSlot(mask);
     }
-    table->count = 0;
+}
+
+// Places a key that is known to be absent from the current arrays
+static void insertEntry(Table *table, ObjString *key, Value value) {
+    int slot = findFreeSlot(table->control, table->capacity, key->hash);
+    if (table->control[slot] == CONTROL_DELETED) table->tombstones--;
+    table->control[slot] = HASH_TAG(key->hash);
+    table->entries[slot].key = key;
+    table->entries[slot].value = value;
+}
 
-    // Re-construct the hash table entries, because the capacity changed, the location of items (that depends on the
-    //      modulo of capacity) will be changed
-    for (int i = 0; i < table->capacity; i++) {
-        Entry *entry = &table->entries[i];
-        if (entry->key == NULL) continue;
+// Takes a slot of the old arrays out of use. It stays deleted rather than empty so probes keep going past it.
+static void removeOldSlot(Table *table, int slot) {
+    table->oldControl[slot] = CONTROL_DELETED;
+    table->oldEntries[slot].key = NULL;
+    table->oldCount--;
+}
+
+static void migrateGroups(Table *table, int groups) {
+    int oldGroups = table->oldCapacity / TABLE_GROUP_SIZE;
+    int end = table->migratedGroups + groups;
+    if (end > oldGroups) end = oldGroups;
+
+    for (int slot = table->migratedGroups * TABLE_GROUP_SIZE; slot < end * TABLE_GROUP_SIZE; slot++) {
+        if (!isFull(table->oldControl[slot])) continue;
+        insertEntry(table, table->oldEntries[slot].key, table->oldEntries[slot].value);
+        removeOldSlot(table, slot);
+    }
+    table->migratedGroups = end;
+
+    if (table->migratedGroups == oldGroups) freeOldArrays(table);
+}
 
-        Entry *dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+static void migrateStep(Table *table) {
+    if (table->oldControl != NULL) {
+        START_TIMER();
+        migrateGroups(table, TABLE_MIGRATE_GROUPS);
+        RECORD_TIME(table);
     }
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+}
+
+// Swaps in empty arrays of the given capacity. Entries move over a few groups at a time from then on, so no single
+// operation pays for rehashing the whole table. Tombstones stay behind in the old arrays. False when the arrays
+// could not be allocated, which leaves the table as it was apart from finishing an earlier resize.
+static bool adjustCapacity(Table *table, int capacity) {
+    START_TIMER();
+#ifdef DEBUG_TABLE_STATS
+    table->stats.resizes++;
+#endif
+
+    // A resize started while the previous one is still running finishes the previous one first
+    if (table->oldControl != NULL) migrateGroups(table, table->oldCapacity / TABLE_GROUP_SIZE);
+
+    // Maps and globals grow as the script says, so their arrays count against the heap limit
+    uint8_t *control = TRY_ALLOCATE(uint8_t, capacity, MEM_TABLE_ENTRIES);
+    Entry *entries = control == NULL ? NULL : TRY_ALLOCATE(Entry, capacity, MEM_TABLE_ENTRIES);
+    if (entries == NULL) {
+        if (control != NULL) FREE_ARRAY(uint8_t, control, capacity, MEM_TABLE_ENTRIES);
+        RECORD_TIME(table);
+        return false;
+    }
+
+    table->oldControl = table->control;
+    table->oldEntries = table->entries;
+    table->oldCapacity = table->capacity;
+    table->oldCount = table->count;
+    table->migratedGroups = 0;
+
+    table->control = control;
     table->entries = entries;
     table->capacity = capacity;
+    table->tombstones = 0;
+    memset(table->control, CONTROL_EMPTY, capacity);
+
+    if (table->oldCapacity == 0) freeOldArrays(table);
+    RECORD_TIME(table);
+    return true;
+}
+
+static bool overloaded(int used, int capacity) {
+    return (size_t) used * TABLE_MAX_LOAD_DENOMINATOR > (size_t) capacity * TABLE_MAX_LOAD_NUMERATOR;
+}
+
+// Shrinks tables that became sparse and compacts the ones that are mostly tombstones
+static void compact(Table *table) {
+    if (table->oldControl != NULL || table->capacity <= TABLE_GROUP_SIZE) return;
+
+    if (table->count * 8 < table->capacity) {
+        adjustCapacity(table, table->capacity / 2);
+    } else if (table->tombstones * 4 > table->capacity) {
+        adjustCapacity(table, table->capacity);
+    }
 }
 
 bool tableSet(Table *table, ObjString *key, Value value) {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+    migrateStep(table);
+
+    START_PROBE();
+    int slot = findSlot(table->control, table->entries, table->capacity, key);
+    if (slot != -1) {
+        RECORD_PROBE(table, keyProbes);
+        table->entries[slot].value = value;
+        return false;
     }
 
-    Entry *entry = findEntry(table->entries, table->capacity, key);
+    // Keys that have not migrated yet move over when they are written
+    bool isNewKey = true;
+    if (table->oldControl != NULL) {
+        int oldSlot = findSlot(table->oldControl, table->oldEntries, table->oldCapacity, key);
+        if (oldSlot != -1) {
+            removeOldSlot(table, oldSlot);
+            table->count--;
+            isNewKey = false;
+        }
+    }
+    RECORD_PROBE(table, keyProbes);
 
-    bool isNewKey = entry->key == NULL;
-    if (isNewKey && IS_NIL(entry->value)) table->count++;
+    if (overloaded(table->count - table->oldCount + table->tombstones + 1, table->capacity)) {
+        // When tombstones are what fills the table, rehashing at the same size is enough
+        int capacity = table->capacity;
+        if (capacity < TABLE_GROUP_SIZE) {
+            capacity = TABLE_GROUP_SIZE;
+        } else if (overloaded((table->count + 1) * 2, capacity)) {
+            capacity *= 2;
+        }
+        // Past the heap limit the table fills up instead, as long as an empty slot is left to end probes. The
+        // interpreter stops at its next check.
+        if (!adjustCapacity(table, capacity) && table->count + table->tombstones + 1 >= table->capacity) {
+            return isNewKey;
+        }
+    }
 
-    entry->key = key;
-    entry->value = value;
+    insertEntry(table, key, value);
+    table->count++;
     return isNewKey;
 }
 
 void tableAddAll(Table *from, Table *to) {
     for (int i = 0; i < from->capacity; i++) {
-        Entry *entry = &from->entries[i];
-        if (entry->key != NULL) {
+        if (isFull(from->control[i])) {
+            Entry *entry = &from->entries[i];
+            tableSet(to, entry->key, entry->value);
+        }
+    }
+    for (int i = 0; i < from->oldCapacity; i++) {
+        if (isFull(from->oldControl[i])) {
+            Entry *entry = &from->oldEntries[i];
             tableSet(to, entry->key, entry->value);
         }
     }
 }
 
+bool tableReserve(Table *table, int count) {
+    int capacity = TABLE_GROUP_SIZE;
+    while (overloaded(count, capacity)) {
+        if (capacity > INT_MAX / 2) return false;
+        capacity *= 2;
+    }
+    return capacity <= table->capacity || adjustCapacity(table, capacity);
+}
+
+Entry *tableIterate(Table *table, int *cursor) {
+    // The cursor runs over the current slots, then over the ones still waiting to migrate
+    for (; *cursor < table->capacity + table->oldCapacity; (*cursor)++) {
+        int slot = *cursor;
+        if (slot < table->capacity) {
+            if (isFull(table->control[slot])) {
+                (*cursor)++;
+                return &table->entries[slot];
+            }
+        } else if (isFull(table->oldControl[slot - table->capacity])) {
+            (*cursor)++;
+            return &table->oldEntries[slot - table->capacity];
+        }
+    }
+    return NULL;
+}
+
 bool tableGet(Table *table, ObjString *key, Value *value) {
     if (table->count == 0) return false;
+    migrateStep(table);
+
+    START_PROBE();
+    int slot = findSlot(table->control, table->entries, table->capacity, key);
+    if (slot != -1) {
+        RECORD_PROBE(table, keyProbes);
+        *value = table->entries[slot].value;
+        return true;
+    }
 
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    if (table->oldControl != NULL) {
+        slot = findSlot(table->oldControl, table->oldEntries, table->oldCapacity, key);
+    }
+    RECORD_PROBE(table, keyProbes);
+    if (slot == -1) return false;
 
-    *value = entry->value;
+    *value = table->oldEntries[slot].value;
     return true;
 }
 
 bool tableDelete(Table *table, ObjString *key) {
     if (table->count == 0) return false;
+    migrateStep(table);
 
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
-
-    // Place a tombstone in the entry.
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    START_PROBE();
+    int slot = findSlot(table->control, table->entries, table->capacity, key);
+    if (slot != -1) {
+        RECORD_PROBE(table, keyProbes);
+        // If the group still has an empty slot no probe ever continued past it, so the slot can become empty
+        // again. Otherwise place a tombstone.
+        const uint8_t *group = &table->control[slot / TABLE_GROUP_SIZE * TABLE_GROUP_SIZE];
+        if (matchEmpty(group) != 0) {
+            table->control[slot] = CONTROL_EMPTY;
+        } else {
+            table->control[slot] = CONTROL_DELETED;
+            table->tombstones++;
+        }
+        table->entries[slot].key = NULL;
+    } else {
+        if (table->oldControl != NULL) {
+            slot = findSlot(table->oldControl, table->oldEntries, table->oldCapacity, key);
+        }
+        RECORD_PROBE(table, keyProbes);
+        if (slot == -1) return false;
+        removeOldSlot(table, slot);
+    }
+    table->count--;
 
+    compact(table);
     return true;
 }
 
+static ObjString *findString(const uint8_t *control, Entry *entries, int capacity,
+                             const char *chars, int length, uint32_t hash) {
+    if (capacity == 0) return NULL;
+    uint8_t tag = HASH_TAG(hash);
+
+    FOR_EACH_GROUP(capacity, hash, group) {
+        const uint8_t *groupControl = &control[group * TABLE_GROUP_SIZE];
+        COUNT_GROUP();
+
+        // Only keys whose control byte matches the 7 hash bits are dereferenced
+        for (GroupMask mask = matchTag(groupControl, tag); mask != 0; mask &= mask - 1) {
+            ObjString *key = entries[(int) group * TABLE_GROUP_SIZE + lowestSlot(mask)].key;
+            if (key->hash == hash && key->length == length &&
+                bytesEqual(key->chars, chars, (size_t) length)) {
+                // We found it.
+                return key;
+            }
+        }
+        // Stop if the group has an empty slot.
+        if (matchEmpty(groupControl) != 0) return NULL;
+    }
+}
+
 ObjString *tableFindString(Table *table, const char *chars, int length,
                            uint32_t hash) {
     if (table->count == 0) return NULL;
+    migrateStep(table);
 
-    uint32_t index = hash % table->capacity;
-
-    while (1) {
-        Entry *entry = &table->entries[index];
-
-        if (entry->key == NULL) {
-            // Stop if we find an empty non-tombstone entry.
-            if (IS_NIL(entry->value)) return NULL;
-        } else if (entry->key->length == length &&
-                   entry->key->hash == hash &&
-                   memcmp(entry->key->chars, chars, length) == 0) {
-            // We found it.
-            return entry->key;
-        }
+    START_PROBE();
+    ObjString *key = findString(table->control, table->entries, table->capacity, chars, length, hash);
+    if (key == NULL && table->oldControl != NULL) {
+        key = findString(table->oldControl, table->oldEntries, table->oldCapacity, chars, length, hash);
+    }
+    RECORD_PROBE(table, stringProbes);
+    return key;
+}
 
-        index = (index + 1) % table->capacity;
+#ifdef DEBUG_TABLE_STATS
+static void printProbes(FILE *out, const char *label, size_t *histogram) {
+    size_t lookups = 0;
+    size_t groups = 0;
+    for (int i = 0; i < TABLE_PROBE_BUCKETS; i++) {
+        lookups += histogram[i];
+        groups += histogram[i] * i;
+    }
+    fprintf(out, "  %-14s %zu lookups, %.2f groups on average:", label, lookups,
+            lookups == 0 ? 0.0 : (double) groups / lookups);
+    for (int i = 0; i < TABLE_PROBE_BUCKETS; i++) {
+        if (histogram[i] == 0) continue;
+        fprintf(out, " %d%s=%zu", i, i == TABLE_PROBE_BUCKETS - 1 ? "+" : "", histogram[i]);
     }
-}
\ No newline at end of file
+    fprintf(out, "\n");
+}
+
+void printTableStats(FILE *out, const char *name, Table *table) {
+    int slots = table->capacity + table->oldCapacity;
+    fprintf(out, "== %s ==\n", name);
+    fprintf(out, "  %d entries in %d slots, load factor %.3f, tombstone ratio %.3f%s\n", table->count, slots,
+            slots == 0 ? 0.0 : (double) table->count / slots,
+            table->capacity == 0 ? 0.0 : (double) table->tombstones / table->capacity,
+            table->oldControl != NULL ? " (resizing)" : "");
+    fprintf(out, "  %zu resizes, %.3f ms resizing\n", table->stats.resizes, table->stats.resizeNanos / 1e6);
+    printProbes(out, "key lookups", table->stats.keyProbes);
+    printProbes(out, "string lookups", table->stats.stringProbes);
+}
+#endif
@@ -13,19 +13,63 @@ typedef struct {
     Value value;
 } Entry;
 
+// Open addressing in groups of TABLE_GROUP_SIZE slots. Each slot has a control byte that is either empty, deleted
+// or holds the low 7 bits of the key's hash, so a whole group can be matched against a key at once.
+#define TABLE_GROUP_SIZE 16
+
+#ifdef DEBUG_TABLE_STATS
+// Lookups by the number of groups they visited, the last bucket also counts longer probes
+#define TABLE_PROBE_BUCKETS 16
+
+typedef struct {
+    // lookups of a key object (get, set, delete) and lookups of string contents (interning)
+    size_t keyProbes[TABLE_PROBE_BUCKETS];
+    size_t stringProbes[TABLE_PROBE_BUCKETS];
+    size_t resizes;
+    // time spent allocating new arrays and migrating entries into them
+    uint64_t resizeNanos;
+} TableStats;
+#endif
+
 typedef struct {
+    // live entries, including the ones still waiting in the old arrays
     int count;
+    // deleted slots that still break up probe sequences
+    int tombstones;
+    // a power of two, and a multiple of TABLE_GROUP_SIZE once allocated
     int capacity;
+    uint8_t* control;
     Entry* entries;
+
+    // While resizing, the previous arrays stay in use and every operation moves a few of their groups over
+    int oldCapacity;
+    int oldCount;
+    int migratedGroups;
+    uint8_t* oldControl;
+    Entry* oldEntries;
+
+#ifdef DEBUG_TABLE_STATS
+    TableStats stats;
+#endif
 } Table;
 
 void initTable(Table* table);
 void freeTable(Table* table);
+// True when the key is new. A table that cannot grow any more drops the entry, with the VM's limitHit set.
 bool tableSet(Table* table, ObjString* key, Value value);
 void tableAddAll(Table* from, Table* to);
+// Makes room for count entries, so filling the table up to that size never resizes it. False when the heap limit
+// or the system refused the memory, or count is more than a table can hold.
+bool tableReserve(Table* table, int count);
+// Walks the live entries, starting with *cursor set to 0. Returns NULL once every entry was visited.
+Entry* tableIterate(Table* table, int* cursor);
 bool tableGet(Table* table, ObjString* key, Value* value);
 bool tableDelete(Table* table, ObjString* key);
 ObjString* tableFindString(Table* table, const char* chars, int length,
                            uint32_t hash);
 
+#ifdef DEBUG_TABLE_STATS
+void printTableStats(FILE* out, const char* name, Table* table);
+#endif
+
 #endif //YAVM_TABLE_H
@@ -7,6 +7,14 @@
 
 void printObject(Value value);
 
+// The maps being printed, innermost first, kept on the C stack so a map that contains itself is printed once
+typedef struct PrintingMap {
+    ObjMap *map;
+    struct PrintingMap *outer;
+} PrintingMap;
+
+static void printNested(Value value, PrintingMap *printing);
+
 void initValueArray(ValueArray *array) {
     array->values = NULL;
     array->capacity = 0;
@@ -18,7 +26,7 @@ void writeValueArray(ValueArray *array, Value value) {
         int oldCapacity = array->capacity;
         array->capacity = GROW_CAPACITY(oldCapacity);
         array->values = GROW_ARRAY(array->values, Value,
-                                   oldCapacity, array->capacity);
+                                   oldCapacity, array->capacity, MEM_CONSTANTS);
     }
 
     array->values[array->count] = value;
@@ -26,11 +34,37 @@ void writeValueArray(ValueArray *array, Value value) {
 }
 
 void freeValueArray(ValueArray *array) {
-    FREE_ARRAY(Value, array->values, array->capacity);
+    FREE_ARRAY(Value, array->values, array->capacity, MEM_CONSTANTS);
     initValueArray(array);
 }
 
 void printValue(Value value) {
+    printNested(value, NULL);
+}
+
+static void printMap(ObjMap *map, PrintingMap *outer) {
+    for (PrintingMap *printing = outer; printing != NULL; printing = printing->outer) {
+        if (printing->map == map) {
+            printf("{...}");
+            return;
+        }
+    }
+    PrintingMap printing = {map, outer};
+    printf("{");
+    int cursor = 0;
+    Entry *entry;
+    for (bool first = true; (entry = tableIterate(&map->table, &cursor)) != NULL; first = false) {
+        printf(first ? "%.*s: " : ", %.*s: ", entry->key->length, entry->key->chars);
+        printNested(entry->value, &printing);
+    }
+    printf("}");
+}
+
+static void printNested(Value value, PrintingMap *printing) {
+    if (IS_MAP(value)) {
+        printMap(AS_MAP(value), printing);
+        return;
+    }
     switch (value.type) {
         case VAL_BOOL:
             printf(AS_BOOL(value) ? "true" : "false");
@@ -50,7 +84,24 @@ void printValue(Value value) {
 void printObject(Value value) {
     switch (OBJ_TYPE(value)) {
         case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
+            // External strings are not null-terminated
+            printf("%.*s", AS_STRING(value)->length, AS_CSTRING(value));
+            break;
+        case OBJ_MAP:
+            printMap(AS_MAP(value), NULL);
+            break;
+        case OBJ_F64ARRAY: {
+            ObjF64Array *array = AS_ARRAY(value);
+            printf("[");
+            for (int i = 0; i < array->length; i++) printf(i == 0 ? "%g" : ", %g", array->values[i]);
+            printf("]");
+            break;
+        }
+        case OBJ_MODULE:
+            printf("<module %s>", AS_MODULE(value)->path->chars);
+            break;
+        case OBJ_IMPORT:
+            printf("<import %.*s>", AS_IMPORT(value)->name->length, AS_IMPORT(value)->name->chars);
             break;
     }
 }
@@ -65,6 +116,8 @@ bool valuesEqual(Value a, Value b) {
             return true;
         case VAL_NUMBER:
             return AS_NUMBER(a) == AS_NUMBER(b);
-        case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_OBJ:
+            if (IS_STRING(a) && IS_STRING(b)) return stringsEqual(AS_STRING(a), AS_STRING(b));
+            return AS_OBJ(a) == AS_OBJ(b);
     }
 }
\ No newline at end of file
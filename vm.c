@@ -3,223 +3,688 @@
 #include <stdio.h>
 #include "debug.h"
 #include "compiler.h"
+#include "bytecode.h"
+#include "prelude.h"
 #include "object.h"
+#include "hash.h"
 #include "memory.h"
+#include "simd.h"
+#include <limits.h>
+#include <math.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 
 
 static InterpretResult run();
 
+static void installPrelude();
+
 static void runtimeError(const char *format, ...);
 
-static void concatenate();
+static bool concatenate(VM *self);
+
+static bool addMany(VM *self, int count);
+
+static ObjString *mapKey(VM *self, Value key);
+
+static bool arrayArithmetic(VM *self, KernelOp op);
+
+static bool arrayIndex(ObjF64Array *array, Value index, int *slot);
+
+static bool reduceArray(VM *self, Opcode op);
 
-VM vm;
+static bool importedValue(ObjImport *import, Value *value);
+
+_Thread_local VM *vm = NULL;
 
 void push(Value value) {
-    *vm.stackTop = value;
-    vm.stackTop++;
+    *vm->stackTop = value;
+    vm->stackTop++;
 }
 
 Value pop() {
-    vm.stackTop--;
-    return *vm.stackTop;
+    vm->stackTop--;
+    return *vm->stackTop;
 }
 
-static Value peek(int distance) {
-    return vm.stackTop[-1 - distance];
-}
+// The same through a VM in a local named self. run() and the helpers it calls use these, since push() and pop()
+// load the thread-local VM every time.
+#define PUSH(value) (*self->stackTop++ = (value))
+#define POP() (*--self->stackTop)
+#define PEEK(distance) (self->stackTop[-1 - (distance)])
 
 static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
 static void resetStack() {
-    vm.stackTop = vm.stack;
+    vm->stackTop = vm->stack;
+}
+
+void setHeapLimit(size_t bytes) {
+    vm->heapLimit = bytes;
+}
+
+void setInstructionBudget(size_t instructions) {
+    vm->instructionBudget = instructions;
+}
+
+void requestCancel(VM *instance) {
+    atomic_store_explicit(&instance->cancelRequested, true, memory_order_relaxed);
+}
+
+bool defineMappedString(const char *name, const char *path) {
+    MappedFile *mapping = mapFile(path);
+    if (mapping == NULL || mapping->size > INT_MAX) return false;
+
+    ObjString *contents = externalString(mapping->data, (int) mapping->size);
+    tableSet(&vm->globals, copyString(name, (int) strlen(name)), OBJ_VAL(contents));
+    return true;
+}
+
+void setScriptPath(const char *path) {
+    free(vm->scriptDirectory);
+    vm->scriptDirectory = NULL;
+    const char *separator = strrchr(path, '/');
+    if (separator == NULL) return;
+    size_t length = (size_t) (separator - path + 1);
+    vm->scriptDirectory = malloc(length + 1);
+    if (vm->scriptDirectory == NULL) return;
+    memcpy(vm->scriptDirectory, path, length);
+    vm->scriptDirectory[length] = '\0';
+}
+
+void setModuleCache(const char *directory) {
+    vm->cacheDirectory = directory;
+}
+
+// The hash seed and the kernels are picked once, by whichever VM starts first. Others wait until they are ready,
+// since nothing may hash before the seed is final.
+static void initProcess() {
+    static atomic_int state = 0;
+    int expected = 0;
+    if (atomic_compare_exchange_strong(&state, &expected, 1)) {
+        initHash();
+        initKernels();
+        initLargePages();
+        atomic_store(&state, 2);
+    }
+    while (atomic_load(&state) != 2) {}
 }
 
-void initVM() {
+void initVM(VM *instance) {
+    initProcess();
+    vm = instance;
+
+    vm->bytesAllocated = 0;
+    vm->heapLimit = 0;
+    vm->instructionBudget = 0;
+    vm->limitHit = LIMIT_NONE;
+    atomic_init(&vm->cancelRequested, false);
+
+    vm->stack = ALLOCATE(Value, MAX_STACK, MEM_VM_STACK);
+    vm->stackCapacity = MAX_STACK;
     resetStack();
-    vm.objects = NULL;
-    initTable(&vm.strings);
-    initTable(&vm.globals);
+    vm->chunk = NULL;
+    vm->objects = NULL;
+    vm->mappings = NULL;
+    initTable(&vm->strings);
+    initTable(&vm->globals);
+    initTable(&vm->prelude);
+    initTable(&vm->modules);
+    vm->module = NULL;
+    vm->moduleChunks = NULL;
+    vm->scriptDirectory = NULL;
+    vm->cacheDirectory = NULL;
+    installPrelude();
 }
 
-void freeVM() {
+void freeVM(VM *instance) {
+    vm = instance;
+    freeModuleChunks();
     freeObjects();
-    freeTable(&vm.strings);
-    freeTable(&vm.globals);
+    freeMappedFiles();
+    freeTable(&vm->strings);
+    freeTable(&vm->globals);
+    freeTable(&vm->prelude);
+    freeTable(&vm->modules);
+    free(vm->scriptDirectory);
+    vm->scriptDirectory = NULL;
+    FREE_ARRAY(Value, vm->stack, vm->stackCapacity, MEM_VM_STACK);
+    vm = NULL;
+}
+
+// Reports the limit that was hit, if any, as a runtime error. Both take the VM so run() can pass the one it cached.
+static bool limitExceeded(VM *self) {
+    switch (self->limitHit) {
+        case LIMIT_NONE:
+            return false;
+        case LIMIT_HEAP:
+            runtimeError("Heap limit of %zu bytes exceeded.", self->heapLimit);
+            break;
+        case LIMIT_INSTRUCTIONS:
+            runtimeError("Instruction budget of %zu exhausted.", self->instructionBudget);
+            break;
+        case LIMIT_CANCELLED:
+            runtimeError("Execution cancelled.");
+            break;
+        case LIMIT_MEMORY:
+            runtimeError("Out of memory.");
+            break;
+    }
+    return true;
+}
+
+// Charges the bytecode run since the last check against the budget and polls for cancellation. Called at jumps
+// so straight-line code pays nothing extra.
+static bool checkLimits(VM *self) {
+    if (self->instructionBudget != 0) {
+        size_t used = (size_t) (self->pc - self->budgetMark);
+        self->budgetMark = self->pc;
+        if (used >= self->budgetLeft) {
+            self->budgetLeft = 0;
+            self->limitHit = LIMIT_INSTRUCTIONS;
+        } else {
+            self->budgetLeft -= used;
+        }
+    }
+    if (atomic_load_explicit(&self->cancelRequested, memory_order_relaxed)) {
+        self->limitHit = LIMIT_CANCELLED;
+    }
+    return limitExceeded(self);
+}
+
+static void resetLimits() {
+    vm->limitHit = LIMIT_NONE;
+    atomic_store_explicit(&vm->cancelRequested, false, memory_order_relaxed);
+    vm->budgetLeft = vm->instructionBudget;
+}
+
+// Pushes are not bounds checked, so the stack grows up front to fit the chunk's locals and temporaries
+static void reserveStack(int slots) {
+    if (slots <= vm->stackCapacity) return;
+    ptrdiff_t depth = vm->stackTop - vm->stack;
+    vm->stack = GROW_ARRAY(vm->stack, Value, vm->stackCapacity, slots, MEM_VM_STACK);
+    vm->stackCapacity = slots;
+    vm->stackTop = vm->stack + depth;
+}
+
+static InterpretResult runChunk(Chunk *chunk) {
+    reserveStack(chunk->maxLocals + chunk->maxTemporaries + MAX_STACK);
+    vm->chunk = chunk;
+    vm->pc = vm->chunk->code;
+    vm->budgetMark = vm->pc;
+
+    // The limits also cover compiling
+    InterpretResult result = checkLimits(vm) ? INTERPRET_RUNTIME_ERROR : run();
+
+    vm->chunk = NULL;
+    return result;
+}
+
+// Runs the prelude compiled into the interpreter, which only defines globals
+static void installPrelude() {
+    if (preludeBytecodeSize == 0) return;
+    Chunk chunk;
+    initChunk(&chunk);
+    BytecodeStatus status = decodeBytecode((const char *) preludeBytecode, preludeBytecodeSize, &chunk, NULL);
+    if (status == BYTECODE_OK) {
+        resetLimits();
+        runChunk(&chunk);
+        tableAddAll(&vm->globals, &vm->prelude);
+    } else {
+        fprintf(stderr, "Prelude %s.\n", bytecodeStatusMessage(status));
+    }
+    freeChunk(&chunk);
 }
 
 InterpretResult interpret(const char *source) {
     Chunk chunk;
     initChunk(&chunk);
+    resetLimits();
 
     if (!compile(source, &chunk)) {
         freeChunk(&chunk);
         return INTERPRET_COMPILE_ERROR;
     }
 
-    vm.chunk = &chunk;
-    vm.pc = vm.chunk->code;
+    InterpretResult result = runChunk(&chunk);
+    freeChunk(&chunk);
+    return result;
+}
+
+InterpretResult interpretStream(MappedFile *source) {
+    resetLimits();
+    Parser *stream = startStream(source->data);
+    if (stream == NULL) return INTERPRET_COMPILE_ERROR;
+
+    InterpretResult result = INTERPRET_OK;
+    for (bool done = false; !done && result == INTERPRET_OK;) {
+        Chunk chunk;
+        initChunk(&chunk);
+        if (!compileSegment(stream, &chunk, &done)) {
+            result = INTERPRET_COMPILE_ERROR;
+        } else {
+            result = runChunk(&chunk);
+        }
+        freeChunk(&chunk);
+        // Names and string constants were copied into the heap, so the compiled part of the source is not needed
+        releaseMappedPrefix(source, streamPosition(stream));
+    }
+    endStream(stream);
+    return result;
+}
+
+InterpretResult interpretBytecode(const char *path) {
+    resetLimits();
+    Chunk chunk;
+    initChunk(&chunk);
+    BytecodeStatus status = loadBytecode(path, &chunk, NULL);
+    if (status != BYTECODE_OK) {
+        fprintf(stderr, "Bytecode file \"%s\" %s.\n", path, bytecodeStatusMessage(status));
+        return INTERPRET_COMPILE_ERROR;
+    }
+
+    InterpretResult result = runChunk(&chunk);
+    freeChunk(&chunk);
+    return result;
+}
+
+InterpretResult interpretCached(const char *source, const char *cacheDirectory) {
+    Chunk chunk;
+    initChunk(&chunk);
+    resetLimits();
 
-    InterpretResult result = run();
+    if (!compileCached(source, &chunk, cacheDirectory)) {
+        freeChunk(&chunk);
+        return INTERPRET_COMPILE_ERROR;
+    }
 
+    InterpretResult result = runChunk(&chunk);
     freeChunk(&chunk);
     return result;
-    return INTERPRET_OK;
+}
+
+InterpretResult interpretAll(const char **sources, int count, int threads) {
+    resetLimits();
+    CompileJob *jobs = ALLOCATE(CompileJob, count, MEM_COMPILE_JOBS);
+    for (int i = 0; i < count; i++) {
+        jobs[i].source = sources[i];
+        initChunk(&jobs[i].chunk);
+    }
+    compileMany(jobs, count, threads);
+
+    InterpretResult result = INTERPRET_OK;
+    for (int i = 0; i < count; i++) {
+        if (!jobs[i].compiled) result = INTERPRET_COMPILE_ERROR;
+    }
+    for (int i = 0; i < count && result == INTERPRET_OK; i++) {
+        result = runChunk(&jobs[i].chunk);
+    }
+
+    for (int i = 0; i < count; i++) freeChunk(&jobs[i].chunk);
+    FREE_ARRAY(CompileJob, jobs, count, MEM_COMPILE_JOBS);
+    return result;
 }
 
 static InterpretResult run() {
-#define READ_BYTE() (*vm.pc++)
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
+    // The current VM cannot change while a chunk runs, so it is read once rather than at every instruction
+    VM *const self = vm;
+#define READ_BYTE() (*self->pc++)
+#define READ_CONSTANT() (self->chunk->constants.values[READ_BYTE()])
 #define READ_SHORT() \
-    (vm.ip += 2, (uint16_t)((vm.ip[-2] << 8) | vm.ip[-1]))
-#define BINARY_OP(valueType, op) \
+    (self->pc += 2, (uint16_t)((self->pc[-2] << 8) | self->pc[-1]))
+#define BINARY_OP(valueType, op, kernel) \
     do { \
-      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-        runtimeError("Operands must be numbers."); \
-        return INTERPRET_RUNTIME_ERROR; \
+      if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+        if (!arrayArithmetic(self, kernel)) return INTERPRET_RUNTIME_ERROR; \
+        break; \
       } \
-      double b = AS_NUMBER(pop()); \
-      double a = AS_NUMBER(pop()); \
-      push(valueType(a op b)); \
+      double b = AS_NUMBER(POP()); \
+      double a = AS_NUMBER(POP()); \
+      PUSH(valueType(a op b)); \
     } while (false)
-#define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_CONSTANT_LONG() \
+    (self->pc += 3, self->chunk->constants.values[(self->pc[-3] << 16) | (self->pc[-2] << 8) | self->pc[-1]])
+// Reads the one byte or three byte operand of a global instruction
+#define READ_GLOBAL_NAME(longOp) \
+    AS_STRING(instruction == (longOp) ? READ_CONSTANT_LONG() : READ_CONSTANT())
 
     while (1) {
 #ifdef DEBUG_TRACE_EXECUTION
         printf("          ");
-        for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+        for (Value *slot = self->stack; slot < self->stackTop; slot++) {
             printf("[ ");
             printValue(*slot);
             printf(" ]");
         }
         printf("\n");
-        disassembleInstruction(vm.chunk, (int) (vm.pc - vm.chunk->code));
+        disassembleInstruction(self->chunk, (int) (self->pc - self->chunk->code));
+#endif
+#ifdef DEBUG_HEAP_PROFILE
+        self->instruction = self->pc;
 #endif
         uint8_t instruction;
         switch (instruction = READ_BYTE()) {
             case OP_CONSTANT: {
                 Value constant = READ_CONSTANT();
-                push(constant);
+                PUSH(constant);
                 break;
             }
+            case OP_CONSTANT_LONG:
+                PUSH(READ_CONSTANT_LONG());
+                break;
             case OP_NEGATE:
-                if (!IS_NUMBER(peek(0))) {
+                if (IS_ARRAY(PEEK(0))) {
+                    PUSH(NUMBER_VAL(-1));
+                    if (!arrayArithmetic(self, KERNEL_MULTIPLY)) return INTERPRET_RUNTIME_ERROR;
+                    break;
+                }
+                if (!IS_NUMBER(PEEK(0))) {
                     runtimeError("Negation operand must be a number.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
 
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
+                PUSH(NUMBER_VAL(-AS_NUMBER(POP())));
                 break;
             case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
+                if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+                    if (!concatenate(self) || limitExceeded(self)) return INTERPRET_RUNTIME_ERROR;
+                } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+                    double b = AS_NUMBER(POP());
+                    double a = AS_NUMBER(POP());
+                    PUSH(NUMBER_VAL(a + b));
+                } else if (IS_ARRAY(PEEK(0)) || IS_ARRAY(PEEK(1))) {
+                    if (!arrayArithmetic(self, KERNEL_ADD)) return INTERPRET_RUNTIME_ERROR;
                 } else {
                     runtimeError("Operands must be two numbers or two strings.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 break;
             }
+            case OP_CONCAT_N:
+                if (!addMany(self, READ_BYTE()) || limitExceeded(self)) return INTERPRET_RUNTIME_ERROR;
+                break;
+            case OP_NEW_MAP: {
+                uint16_t capacity = READ_SHORT();
+                ObjMap *map = newMap(capacity);
+                if (map == NULL) {
+                    limitExceeded(self);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                PUSH(OBJ_VAL(map));
+                if (limitExceeded(self)) return INTERPRET_RUNTIME_ERROR;
+                break;
+            }
+            case OP_MAP_ENTRY: {
+                ObjString *key = mapKey(self, PEEK(1));
+                if (key == NULL) return INTERPRET_RUNTIME_ERROR;
+                tableSet(&AS_MAP(PEEK(2))->table, key, PEEK(0));
+                self->stackTop -= 2;
+                if (limitExceeded(self)) return INTERPRET_RUNTIME_ERROR;
+                break;
+            }
+            case OP_GET_INDEX: {
+                if (IS_ARRAY(PEEK(1))) {
+                    int slot;
+                    if (!arrayIndex(AS_ARRAY(PEEK(1)), PEEK(0), &slot)) return INTERPRET_RUNTIME_ERROR;
+                    Value value = NUMBER_VAL(AS_ARRAY(PEEK(1))->values[slot]);
+                    self->stackTop -= 2;
+                    PUSH(value);
+                    break;
+                }
+                if (!IS_MAP(PEEK(1))) {
+                    runtimeError("Only maps and arrays can be indexed.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                ObjString *key = mapKey(self, PEEK(0));
+                if (key == NULL) return INTERPRET_RUNTIME_ERROR;
+                // Missing keys read as nil
+                Value value = NIL_VAL;
+                tableGet(&AS_MAP(PEEK(1))->table, key, &value);
+                self->stackTop -= 2;
+                PUSH(value);
+                break;
+            }
+            case OP_SET_INDEX: {
+                if (IS_ARRAY(PEEK(2))) {
+                    int slot;
+                    if (!arrayIndex(AS_ARRAY(PEEK(2)), PEEK(1), &slot)) return INTERPRET_RUNTIME_ERROR;
+                    if (!IS_NUMBER(PEEK(0))) {
+                        runtimeError("Array elements must be numbers.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    AS_ARRAY(PEEK(2))->values[slot] = AS_NUMBER(PEEK(0));
+                    Value value = PEEK(0);
+                    self->stackTop -= 3;
+                    PUSH(value);
+                    break;
+                }
+                if (!IS_MAP(PEEK(2))) {
+                    runtimeError("Only maps and arrays can be indexed.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                ObjString *key = mapKey(self, PEEK(1));
+                if (key == NULL) return INTERPRET_RUNTIME_ERROR;
+                // Assignment is an expression, so the value stays on the stack
+                Value value = PEEK(0);
+                tableSet(&AS_MAP(PEEK(2))->table, key, value);
+                self->stackTop -= 3;
+                PUSH(value);
+                if (limitExceeded(self)) return INTERPRET_RUNTIME_ERROR;
+                break;
+            }
+            case OP_BUILD_ARRAY: {
+                int count = READ_BYTE();
+                Value *elements = self->stackTop - count;
+                ObjF64Array *array = newArray(count);
+                if (array == NULL) {
+                    limitExceeded(self);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                for (int i = 0; i < count; i++) {
+                    if (!IS_NUMBER(elements[i])) {
+                        runtimeError("Array elements must be numbers.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    array->values[i] = AS_NUMBER(elements[i]);
+                }
+                self->stackTop = elements;
+                PUSH(OBJ_VAL(array));
+                if (limitExceeded(self)) return INTERPRET_RUNTIME_ERROR;
+                break;
+            }
+            case OP_FILL_ARRAY: {
+                if (!IS_NUMBER(PEEK(1))) {
+                    runtimeError("Array elements must be numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                double count = IS_NUMBER(PEEK(0)) ? AS_NUMBER(PEEK(0)) : -1;
+                if (count < 0 || count > INT_MAX || count != (int) count) {
+                    runtimeError("Array size must be a non-negative integer.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (count > ARRAY_MAX_LENGTH) {
+                    runtimeError("Array size %.15g is over the limit of %d.", count, ARRAY_MAX_LENGTH);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                double value = AS_NUMBER(PEEK(1));
+                ObjF64Array *array = newArray((int) count);
+                if (array == NULL) {
+                    limitExceeded(self);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (value != 0) {
+                    for (int i = 0; i < array->length; i++) array->values[i] = value;
+                }
+                self->stackTop -= 2;
+                PUSH(OBJ_VAL(array));
+                if (limitExceeded(self)) return INTERPRET_RUNTIME_ERROR;
+                break;
+            }
+            case OP_LENGTH: {
+                Value value = POP();
+                if (IS_ARRAY(value)) {
+                    PUSH(NUMBER_VAL(AS_ARRAY(value)->length));
+                } else if (IS_STRING(value)) {
+                    PUSH(NUMBER_VAL(AS_STRING(value)->length));
+                } else if (IS_MAP(value)) {
+                    PUSH(NUMBER_VAL(AS_MAP(value)->table.count));
+                } else {
+                    runtimeError("Only strings, maps and arrays have a length.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+            case OP_SUM:
+            case OP_MIN:
+            case OP_MAX:
+            case OP_DOT:
+                if (!reduceArray(self, instruction)) return INTERPRET_RUNTIME_ERROR;
+                break;
             case OP_SUBTRACT:
-                BINARY_OP(NUMBER_VAL, -);
+                BINARY_OP(NUMBER_VAL, -, KERNEL_SUBTRACT);
                 break;
             case OP_MULTIPLY:
-                BINARY_OP(NUMBER_VAL, *);
+                BINARY_OP(NUMBER_VAL, *, KERNEL_MULTIPLY);
                 break;
             case OP_DIVIDE:
-                BINARY_OP(NUMBER_VAL, /);
+                BINARY_OP(NUMBER_VAL, /, KERNEL_DIVIDE);
                 break;
             case OP_NIL:
-                push(NIL_VAL);
+                PUSH(NIL_VAL);
                 break;
             case OP_TRUE:
-                push(BOOL_VAL(true));
+                PUSH(BOOL_VAL(true));
                 break;
             case OP_FALSE:
-                push(BOOL_VAL(false));
+                PUSH(BOOL_VAL(false));
                 break;
             case OP_NOT:
-                push(BOOL_VAL(isFalsey(pop())));
+                // Negates a mask elementwise, so non-zero elements become 0 and zeros become 1
+                if (IS_ARRAY(PEEK(0))) {
+                    PUSH(NUMBER_VAL(0));
+                    if (!arrayArithmetic(self, KERNEL_EQUAL)) return INTERPRET_RUNTIME_ERROR;
+                    break;
+                }
+                PUSH(BOOL_VAL(isFalsey(POP())));
                 break;
             case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
+                Value b = POP();
+                Value a = POP();
+                PUSH(BOOL_VAL(valuesEqual(a, b)));
                 break;
             }
             case OP_GREATER:
-                BINARY_OP(BOOL_VAL, >);
+                BINARY_OP(BOOL_VAL, >, KERNEL_GREATER);
                 break;
             case OP_LESS:
-                BINARY_OP(BOOL_VAL, <);
+                BINARY_OP(BOOL_VAL, <, KERNEL_LESS);
                 break;
             case OP_RETURN: {
                 // Exit interpreter.
+                if (checkLimits(self)) return INTERPRET_RUNTIME_ERROR;
                 return INTERPRET_OK;
             }
             case OP_PRINT: {
-                printValue(pop());
+                printValue(POP());
                 printf("\n");
                 break;
             }
             case OP_POP:
-                pop();
+                self->stackTop--;
                 break;
 
-            case OP_DEFINE_GLOBAL: {
-                ObjString *name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
+            case OP_DEFINE_GLOBAL:
+            case OP_DEFINE_GLOBAL_LONG: {
+                ObjString *name = READ_GLOBAL_NAME(OP_DEFINE_GLOBAL_LONG);
+                tableSet(&self->globals, name, PEEK(0));
+                self->stackTop--;
+                if (limitExceeded(self)) return INTERPRET_RUNTIME_ERROR;
                 break;
             }
 
-            case OP_GET_GLOBAL: {
-                ObjString *name = READ_STRING();
+            case OP_GET_GLOBAL:
+            case OP_GET_GLOBAL_LONG: {
+                ObjString *name = READ_GLOBAL_NAME(OP_GET_GLOBAL_LONG);
                 Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
+                if (!tableGet(&self->globals, name, &value)) {
                     runtimeError("Undefined variable '%s'.", name->chars);
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                push(value);
+                if (IS_IMPORT(value)) {
+                    // Later reads find the value itself
+                    if (!importedValue(AS_IMPORT(value), &value)) return INTERPRET_RUNTIME_ERROR;
+                    tableSet(&self->globals, name, value);
+                }
+                PUSH(value);
                 break;
             }
-            case OP_SET_GLOBAL: { // assignment is an expression, so it needs to leave that value there
+            case OP_SET_GLOBAL:
+            case OP_SET_GLOBAL_LONG: { // assignment is an expression, so it needs to leave that value there
                 // in case the assignment is nested inside some larger expression
-                ObjString *name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
+                ObjString *name = READ_GLOBAL_NAME(OP_SET_GLOBAL_LONG);
+                if (tableSet(&self->globals, name, PEEK(0))) {
+                    tableDelete(&self->globals, name);
                     runtimeError("Undefined variable '%s'.", name->chars);
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 break;
             }
 
+            case OP_IMPORT:
+            case OP_IMPORT_LONG: {
+                ObjString *name = READ_GLOBAL_NAME(OP_IMPORT_LONG);
+                ObjString *path = AS_STRING(PEEK(0));
+                ObjModule *module = findModule(path);
+                if (module == NULL) {
+                    runtimeError("Could not find module '%.*s'.", path->length, path->chars);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                tableSet(&self->globals, name, OBJ_VAL(newImport(module, name)));
+                self->stackTop--;
+                if (limitExceeded(self)) return INTERPRET_RUNTIME_ERROR;
+                break;
+            }
+
             case OP_GET_LOCAL: {
                 uint8_t slot = READ_BYTE();
-                push(vm.stack[slot]);
+                PUSH(self->stack[slot]);
                 break;
             }
             case OP_SET_LOCAL: {
                 uint8_t slot = READ_BYTE();
-                vm.stack[slot] = peek(0);
+                self->stack[slot] = PEEK(0);
+                break;
+            }
+            case OP_GET_LOCAL_LONG: {
+                uint16_t slot = READ_SHORT();
+                PUSH(self->stack[slot]);
                 break;
             }
+            case OP_SET_LOCAL_LONG: {
+                uint16_t slot = READ_SHORT();
+                self->stack[slot] = PEEK(0);
+                break;
+            }
+            // The budget is charged before jumping and the mark moves with the jump, so the bytes jumped over
+            // are not counted as run
             case OP_JUMP_IF_FALSE: {
                 uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0))) vm.pc += offset;
+                if (checkLimits(self)) return INTERPRET_RUNTIME_ERROR;
+                if (isFalsey(PEEK(0))) {
+                    self->pc += offset;
+                    self->budgetMark = self->pc;
+                }
                 break;
             }
 
             case OP_JUMP: {
                 uint16_t offset = READ_SHORT();
-                vm.pc += offset;
+                if (checkLimits(self)) return INTERPRET_RUNTIME_ERROR;
+                self->pc += offset;
+                self->budgetMark = self->pc;
                 break;
             }
 
@@ -227,30 +692,283 @@ static InterpretResult run() {
         }
 #undef BINARY_OP
 #undef READ_CONSTANT
-#undef READ_STRING
+#undef READ_CONSTANT_LONG
+#undef READ_GLOBAL_NAME
 #undef READ_BYTE
 #undef READ_SHORT
     }
 }
 
 
-static void concatenate() {
-    ObjString *b = AS_STRING(pop());
-    ObjString *a = AS_STRING(pop());
+// Strings can double in length with every addition, so their characters are refused past the heap limit
+static bool concatenate(VM *self) {
+    ObjString *b = AS_STRING(PEEK(0));
+    ObjString *a = AS_STRING(PEEK(1));
 
+    if ((size_t) a->length + b->length > INT_MAX) {
+        runtimeError("String too long.");
+        return false;
+    }
     int length = a->length + b->length;
-    char *chars = ALLOCATE(char, length + 1);
+    char *chars = TRY_ALLOCATE(char, length + 1, MEM_STRING_CHARS);
+    if (chars == NULL) {
+        limitExceeded(self);
+        return false;
+    }
     memcpy(chars, a->chars, a->length);
     memcpy(chars + a->length, b->chars, b->length);
     chars[length] = '\0';
 
-    ObjString *result = takeString(chars, length);
-    push(OBJ_VAL(result));
+    ObjString *result = makeString(chars, length);
+    self->stackTop -= 2;
+    PUSH(OBJ_VAL(result));
+    return true;
+}
+
+// Adds the top count values one pair at a time, for chains that mix arrays with numbers
+static bool addPairs(VM *self, int count) {
+    Value *operands = self->stackTop - count;
+    self->stackTop = operands + 1;
+    for (int i = 1; i < count; i++) {
+        PUSH(operands[i]);
+        if (IS_NUMBER(operands[0]) && IS_NUMBER(operands[1])) {
+            double b = AS_NUMBER(POP());
+            operands[0] = NUMBER_VAL(AS_NUMBER(operands[0]) + b);
+        } else if (!arrayArithmetic(self, KERNEL_ADD)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Adds the top count values. Adding left to right only succeeds when they are all numbers or all strings.
+static bool addMany(VM *self, int count) {
+    Value *operands = self->stackTop - count;
+    for (int i = 0; i < count; i++) {
+        if (IS_ARRAY(operands[i])) return addPairs(self, count);
+    }
+    bool strings = IS_STRING(operands[0]);
+    size_t length = 0;
+    for (int i = 0; i < count; i++) {
+        if (strings ? !IS_STRING(operands[i]) : !IS_NUMBER(operands[i])) {
+            runtimeError("Operands must be two numbers or two strings.");
+            return false;
+        }
+        if (strings) length += AS_STRING(operands[i])->length;
+    }
+
+    if (!strings) {
+        double sum = AS_NUMBER(operands[0]);
+        for (int i = 1; i < count; i++) sum += AS_NUMBER(operands[i]);
+        self->stackTop = operands;
+        PUSH(NUMBER_VAL(sum));
+        return true;
+    }
+
+    if (length > INT_MAX) {
+        runtimeError("String too long.");
+        return false;
+    }
+    char *chars = TRY_ALLOCATE(char, length + 1, MEM_STRING_CHARS);
+    if (chars == NULL) {
+        limitExceeded(self);
+        return false;
+    }
+    char *end = chars;
+    for (int i = 0; i < count; i++) {
+        ObjString *string = AS_STRING(operands[i]);
+        memcpy(end, string->chars, string->length);
+        end += string->length;
+    }
+    *end = '\0';
+
+    self->stackTop = operands;
+    PUSH(OBJ_VAL(makeString(chars, (int) length)));
+    return true;
+}
+
+// Map keys are interned strings. Constants are interned already, built strings are interned on first use as a key.
+static ObjString *mapKey(VM *self, Value key) {
+    if (!IS_STRING(key)) {
+        runtimeError("Map keys must be strings.");
+        return NULL;
+    }
+    ObjString *string = AS_STRING(key);
+    if (string->interned) return string;
+    string = internString(string);
+    // Interning adds to vm.strings, which may have stopped growing at the heap limit
+    return limitExceeded(self) ? NULL : string;
+}
+
+// Runs a kernel over the top two values, where at least one is an array and the other an array of the same length or
+// a number. Comparisons give masks of 1s and 0s.
+static bool arrayArithmetic(VM *self, KernelOp op) {
+    Value b = PEEK(0);
+    Value a = PEEK(1);
+    if (!(IS_ARRAY(a) || IS_NUMBER(a)) || !(IS_ARRAY(b) || IS_NUMBER(b)) || !(IS_ARRAY(a) || IS_ARRAY(b))) {
+        runtimeError("Operands must be numbers or arrays.");
+        return false;
+    }
+
+    int length = IS_ARRAY(a) ? AS_ARRAY(a)->length : AS_ARRAY(b)->length;
+    if (IS_ARRAY(a) && IS_ARRAY(b) && AS_ARRAY(b)->length != length) {
+        runtimeError("Array lengths differ (%d and %d).", length, AS_ARRAY(b)->length);
+        return false;
+    }
+
+    ObjF64Array *result = newArray(length);
+    if (result == NULL) {
+        limitExceeded(self);
+        return false;
+    }
+    if (!IS_ARRAY(a)) {
+        // The kernels take the number on the right, so spread it into the result and combine in place
+        double number = AS_NUMBER(a);
+        for (int i = 0; i < length; i++) result->values[i] = number;
+        kernels->binary[op](result->values, result->values, AS_ARRAY(b)->values, length);
+    } else if (!IS_ARRAY(b)) {
+        kernels->scalar[op](result->values, AS_ARRAY(a)->values, AS_NUMBER(b), length);
+    } else {
+        kernels->binary[op](result->values, AS_ARRAY(a)->values, AS_ARRAY(b)->values, length);
+    }
+
+    self->stackTop -= 2;
+    PUSH(OBJ_VAL(result));
+    return !limitExceeded(self);
+}
+
+static bool arrayIndex(ObjF64Array *array, Value index, int *slot) {
+    // NaN fails every comparison, so it is caught with the other non-integers
+    double number = IS_NUMBER(index) ? AS_NUMBER(index) : NAN;
+    if (number != number) {
+        runtimeError("Array index must be an integer.");
+        return false;
+    }
+    // Converting a double outside the range of int is undefined, so the range is checked first
+    if (number < 0 || number >= array->length) {
+        runtimeError("Array index %.15g out of bounds for length %d.", number, array->length);
+        return false;
+    }
+    *slot = (int) number;
+    if (*slot != number) {
+        runtimeError("Array index must be an integer.");
+        return false;
+    }
+    return true;
+}
+
+// sum, min and max of one array, or the dot product of two
+static bool reduceArray(VM *self, Opcode op) {
+    int operands = op == OP_DOT ? 2 : 1;
+    for (int i = 0; i < operands; i++) {
+        if (!IS_ARRAY(PEEK(i))) {
+            runtimeError("Operand must be an array.");
+            return false;
+        }
+    }
+
+    ObjF64Array *array = AS_ARRAY(PEEK(operands - 1));
+    double result;
+    switch (op) {
+        case OP_SUM:
+            result = kernels->sum(array->values, array->length);
+            break;
+        case OP_MIN:
+            result = array->length == 0 ? INFINITY : kernels->min(array->values, array->length);
+            break;
+        case OP_MAX:
+            result = array->length == 0 ? -INFINITY : kernels->max(array->values, array->length);
+            break;
+        default: {
+            ObjF64Array *other = AS_ARRAY(PEEK(0));
+            if (other->length != array->length) {
+                runtimeError("Array lengths differ (%d and %d).", array->length, other->length);
+                return false;
+            }
+            result = kernels->dot(array->values, other->values, array->length);
+            break;
+        }
+    }
+
+    self->stackTop -= operands;
+    PUSH(NUMBER_VAL(result));
+    return true;
 }
 
 struct sObj;
 
 
+// Runs the module's source on a stack of its own and with its own globals, in the middle of the instruction that
+// first read one of its names
+static bool runModule(ObjModule *module) {
+    Chunk *chunk = moduleChunk(module);
+    if (chunk == NULL) {
+        module->state = MODULE_FAILED;
+        runtimeError("Could not load module '%s'.", module->path->chars);
+        return false;
+    }
+
+    Chunk *caller = vm->chunk;
+    uint8_t *pc = vm->pc;
+    uint8_t *budgetMark = vm->budgetMark;
+    Value *stack = vm->stack;
+    Value *stackTop = vm->stackTop;
+    int stackCapacity = vm->stackCapacity;
+    ObjModule *importer = vm->module;
+    Table globals = vm->globals;
+
+    vm->stack = ALLOCATE(Value, MAX_STACK, MEM_VM_STACK);
+    vm->stackCapacity = MAX_STACK;
+    resetStack();
+    vm->module = module;
+    vm->globals = module->globals;
+    module->state = MODULE_LOADING;
+    InterpretResult result = runChunk(chunk);
+    module->state = result == INTERPRET_OK ? MODULE_LOADED : MODULE_FAILED;
+    module->globals = vm->globals;
+
+    FREE_ARRAY(Value, vm->stack, vm->stackCapacity, MEM_VM_STACK);
+    vm->chunk = caller;
+    vm->pc = pc;
+    // The module's instructions were charged as it ran, the caller's since its last jump still have to be
+    vm->budgetMark = budgetMark;
+    vm->stack = stack;
+    vm->stackTop = stackTop;
+    vm->stackCapacity = stackCapacity;
+    vm->module = importer;
+    vm->globals = globals;
+    if (result != INTERPRET_OK) resetStack();
+    return result == INTERPRET_OK;
+}
+
+// The value of the name the import refers to, after running its module if that has not happened yet
+static bool importedValue(ObjImport *import, Value *value) {
+    ObjModule *module = import->module;
+    if (import->resolving || module->state == MODULE_LOADING) {
+        runtimeError("Import cycle through '%s' in module '%s'.", import->name->chars, module->path->chars);
+        return false;
+    }
+    if (module->state == MODULE_FAILED) {
+        runtimeError("Module '%s' failed to load.", module->path->chars);
+        return false;
+    }
+    if (module->state == MODULE_UNLOADED && !runModule(module)) return false;
+
+    if (!tableGet(&module->globals, import->name, value)) {
+        runtimeError("Module '%s' does not define '%s'.", module->path->chars, import->name->chars);
+        return false;
+    }
+    if (IS_IMPORT(*value)) {
+        // The module imported the name itself
+        import->resolving = true;
+        bool resolved = importedValue(AS_IMPORT(*value), value);
+        import->resolving = false;
+        if (!resolved) return false;
+        tableSet(&module->globals, import->name, *value);
+    }
+    return true;
+}
+
 static void runtimeError(const char *format, ...) {
     va_list args;
     va_start(args, format);
@@ -258,9 +976,13 @@ static void runtimeError(const char *format, ...) {
     va_end(args);
     fputs("\n", stderr);
 
-    size_t instruction = vm.pc - vm.chunk->code;
-    int line = vm.chunk->lines[instruction];
-    fprintf(stderr, "[line %d] in script\n", line);
+    size_t instruction = vm->pc - vm->chunk->code;
+    int line = getLine(vm->chunk, (int) instruction - 1);
+    if (vm->module != NULL) {
+        fprintf(stderr, "[line %d] in module %s\n", line, vm->module->path->chars);
+    } else {
+        fprintf(stderr, "[line %d] in script\n", line);
+    }
 
     resetStack();
 }
\ No newline at end of file
@@ -1,23 +1,68 @@
 #include "chunk.h"
 #include "value.h"
 #include "table.h"
+#include "memory.h"
+#include "module.h"
 
 #ifndef VM_H
 #define VM_H
+// Stack slots for temporaries, on top of the locals and the operand runs of the chunk being run
 #define MAX_STACK 256
-typedef struct {
+
+#include <stdatomic.h>
+
+// Which resource limit stopped the script
+typedef enum {
+    LIMIT_NONE,
+    LIMIT_HEAP,
+    LIMIT_INSTRUCTIONS,
+    LIMIT_CANCELLED,
+    // The system could not provide memory the script asked for
+    LIMIT_MEMORY
+} LimitKind;
+
+// Everything one interpreter owns. Any number of VMs can live in a process, each used by one thread at a time.
+typedef struct VM {
 	Chunk* chunk;
     // Program counter
     uint8_t* pc;
+#ifdef DEBUG_HEAP_PROFILE
+    // Start of the instruction being executed, pc has already moved past it
+    uint8_t* instruction;
+#endif
 
-    Value stack[MAX_STACK];
+    Value* stack;
     Value* stackTop;
+    int stackCapacity;
 
     Obj* objects;
+    // Files whose bytes back external strings
+    MappedFile* mappings;
 
     Table strings;
 
     Table globals;
+    // Globals the prelude defined, which every module starts with
+    Table prelude;
+
+    // Modules by canonical path, the one running now (NULL for the main script) and the compiled chunks of all
+    Table modules;
+    ObjModule* module;
+    ModuleChunk* moduleChunks;
+    // Where imports in the main script are looked up, ending with a separator. NULL for the working directory.
+    char* scriptDirectory;
+    // Where compiled modules are cached on disk, or NULL
+    const char* cacheDirectory;
+
+    // Resource governor, a zero limit means unlimited
+    size_t bytesAllocated;
+    size_t heapLimit;
+    size_t instructionBudget;
+    // Bytecode left to run before the budget is exhausted, and where it was last charged
+    size_t budgetLeft;
+    uint8_t* budgetMark;
+    LimitKind limitHit;
+    atomic_bool cancelRequested;
 } VM;
 
 typedef enum {
@@ -27,12 +72,40 @@ typedef enum {
 } InterpretResult;
 
 
-void initVM();
-void freeVM();
+// The VM this thread is working for. The runtime reaches its state through this instead of taking a VM
+// everywhere, and the entry points in yavm.h set it for the duration of each call.
+extern _Thread_local VM* vm;
+
+// Both make instance the current VM
+void initVM(VM* instance);
+void freeVM(VM* instance);
 
 InterpretResult interpret(const char* code);
+// Compiles and runs a mapped source a segment at a time, so code that has run is freed and the parts of the file
+// already compiled are released. A syntax error is only found once the segments before it have run.
+InterpretResult interpretStream(MappedFile* source);
+// Runs a chunk compiled ahead of time, see bytecode.h
+InterpretResult interpretBytecode(const char* path);
+// Like interpret(), but loads the chunk from the cache in cacheDirectory when the same source was compiled before
+InterpretResult interpretCached(const char* source, const char* cacheDirectory);
+// Compiles all the sources, on up to threads threads or one per core when threads is 0, then runs them in order.
+// Nothing runs if any of them fails to compile.
+InterpretResult interpretAll(const char** sources, int count, int threads);
+
+// Limits apply to the following calls of interpret()
+void setHeapLimit(size_t bytes);
+// The budget counts bytes of bytecode executed and is charged at jumps
+void setInstructionBudget(size_t instructions);
+// Stops the script instance is running at its next check, safe to call from another thread or a signal handler
+void requestCancel(VM* instance);
+
+// Imports in the main script are relative to the directory of the script at path
+void setScriptPath(const char* path);
+// Compiled modules are cached in directory like interpretCached() does for scripts
+void setModuleCache(const char* directory);
 
-extern VM vm;
+// Maps the file at path and binds its contents to the global name without copying them
+bool defineMappedString(const char* name, const char* path);
 
 void push(Value value);
 Value pop();
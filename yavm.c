@@ -0,0 +1,230 @@
+//
+// The embedding interface, see yavm.h. Each entry point makes its VM the current one for the thread while it runs.
+//
+
+#include <stdlib.h>
+
+#include "yavm.h"
+#include "bytecode.h"
+#include "compiler.h"
+#include "intern.h"
+#include "memory.h"
+#include "profiler.h"
+#include "scanner.h"
+#include "snapshot.h"
+#include "vm.h"
+
+// Returns the VM that was current before, for leave() to restore
+static VM* enter(VM* instance) {
+    VM* previous = vm;
+    vm = instance;
+    return previous;
+}
+
+static void leave(VM* previous) {
+    vm = previous;
+}
+
+static YavmResult resultOf(InterpretResult result) {
+    switch (result) {
+        case INTERPRET_OK: return YAVM_OK;
+        case INTERPRET_COMPILE_ERROR: return YAVM_COMPILE_ERROR;
+        case INTERPRET_RUNTIME_ERROR: return YAVM_RUNTIME_ERROR;
+    }
+    return YAVM_RUNTIME_ERROR;
+}
+
+YavmVM* yavmNew() {
+    VM* instance = (VM*) malloc(sizeof(VM));
+    if (instance == NULL) return NULL;
+#ifdef DEBUG_HEAP_PROFILE
+    const char* sampleRate = getenv("YAVM_HEAP_SAMPLE_RATE");
+    if (sampleRate != NULL) setHeapProfileSampleRate(atoi(sampleRate));
+#endif
+    VM* previous = vm;
+    initVM(instance);
+    leave(previous);
+    return instance;
+}
+
+void yavmFree(YavmVM* instance) {
+    VM* previous = vm;
+    freeVM(instance);
+    leave(previous == instance ? NULL : previous);
+    free(instance);
+}
+
+YavmResult yavmInterpret(YavmVM* instance, const char* source) {
+    VM* previous = enter(instance);
+    InterpretResult result = interpret(source);
+    leave(previous);
+    return resultOf(result);
+}
+
+YavmResult yavmInterpretCached(YavmVM* instance, const char* source, const char* cacheDirectory) {
+    VM* previous = enter(instance);
+    InterpretResult result = interpretCached(source, cacheDirectory);
+    leave(previous);
+    return resultOf(result);
+}
+
+YavmResult yavmInterpretAll(YavmVM* instance, const char** sources, int count, int threads) {
+    VM* previous = enter(instance);
+    InterpretResult result = interpretAll(sources, count, threads);
+    leave(previous);
+    return resultOf(result);
+}
+
+YavmResult yavmInterpretStream(YavmVM* instance, const char* path) {
+    VM* previous = enter(instance);
+    MappedFile* source = mapSource(path);
+    YavmResult result = source == NULL ? YAVM_FILE_ERROR : resultOf(interpretStream(source));
+    leave(previous);
+    return result;
+}
+
+YavmResult yavmInterpretBytecode(YavmVM* instance, const char* path) {
+    VM* previous = enter(instance);
+    InterpretResult result = interpretBytecode(path);
+    leave(previous);
+    return resultOf(result);
+}
+
+YavmResult yavmCompileAll(YavmVM* instance, const char** sources, const char** outputs, int count, int threads) {
+    VM* previous = enter(instance);
+    CompileJob* jobs = ALLOCATE(CompileJob, count, MEM_COMPILE_JOBS);
+    for (int i = 0; i < count; i++) {
+        jobs[i].source = sources[i];
+        initChunk(&jobs[i].chunk);
+    }
+
+    compileMany(jobs, count, threads);
+
+    YavmResult result = YAVM_OK;
+    for (int i = 0; i < count; i++) {
+        if (!jobs[i].compiled) {
+            result = YAVM_COMPILE_ERROR;
+        } else if (result == YAVM_OK && !writeBytecode(outputs[i], &jobs[i].chunk, sources[i])) {
+            fprintf(stderr, "Could not write file \"%s\".\n", outputs[i]);
+            result = YAVM_FILE_ERROR;
+        }
+        freeChunk(&jobs[i].chunk);
+    }
+    FREE_ARRAY(CompileJob, jobs, count, MEM_COMPILE_JOBS);
+    leave(previous);
+    return result;
+}
+
+void yavmSetHeapLimit(YavmVM* instance, size_t bytes) {
+    VM* previous = enter(instance);
+    setHeapLimit(bytes);
+    leave(previous);
+}
+
+void yavmSetInstructionBudget(YavmVM* instance, size_t instructions) {
+    VM* previous = enter(instance);
+    setInstructionBudget(instructions);
+    leave(previous);
+}
+
+void yavmRequestCancel(YavmVM* instance) {
+    // Called from other threads, so it must not touch the current VM
+    requestCancel(instance);
+}
+
+void yavmSetScriptPath(YavmVM* instance, const char* path) {
+    VM* previous = enter(instance);
+    setScriptPath(path);
+    leave(previous);
+}
+
+void yavmSetModuleCache(YavmVM* instance, const char* directory) {
+    VM* previous = enter(instance);
+    setModuleCache(directory);
+    leave(previous);
+}
+
+bool yavmDefineMappedString(YavmVM* instance, const char* name, const char* path) {
+    VM* previous = enter(instance);
+    bool defined = defineMappedString(name, path);
+    leave(previous);
+    return defined;
+}
+
+YavmResult yavmWriteSnapshot(YavmVM* instance, const char* path, const char* source) {
+    VM* previous = enter(instance);
+    SnapshotStatus status = writeSnapshot(path, sourceFingerprint(source));
+    leave(previous);
+    if (status == SNAPSHOT_OK) return YAVM_OK;
+    fprintf(stderr, "Snapshot file \"%s\" %s.\n", path, snapshotStatusMessage(status));
+    return status == SNAPSHOT_UNWRITABLE ? YAVM_FILE_ERROR : YAVM_RUNTIME_ERROR;
+}
+
+bool yavmLoadSnapshot(YavmVM* instance, const char* path) {
+    VM* previous = enter(instance);
+    SnapshotStatus status = loadSnapshot(path);
+    leave(previous);
+    if (status != SNAPSHOT_OK) fprintf(stderr, "Snapshot file \"%s\" %s.\n", path, snapshotStatusMessage(status));
+    return status == SNAPSHOT_OK;
+}
+
+bool yavmVerifySnapshot(YavmVM* instance, const char* path, const char* source) {
+    VM* previous = enter(instance);
+    SnapshotStatus status = verifySnapshot(path, sourceFingerprint(source));
+    leave(previous);
+    if (status != SNAPSHOT_OK) fprintf(stderr, "Snapshot file \"%s\" %s.\n", path, snapshotStatusMessage(status));
+    return status == SNAPSHOT_OK;
+}
+
+void yavmShareStrings() {
+    enableSharedInterning();
+}
+
+void yavmFreeSharedStrings() {
+    freeSharedStrings();
+}
+
+int yavmScan(YavmVM* instance, const char* source, int* errorCount) {
+    VM* previous = enter(instance);
+    TokenBuffer tokens;
+    initTokenBuffer(&tokens);
+    scanTokens(&tokens, source);
+    *errorCount = tokens.errorCount;
+    // Not counting the TOKEN_EOF
+    int count = tokens.count - 1;
+    freeTokenBuffer(&tokens);
+    leave(previous);
+    return count;
+}
+
+#ifdef DEBUG_HEAP_PROFILE
+static void dumpHeapProfile() {
+    const char* path = getenv("YAVM_HEAP_PROFILE");
+    if (path != NULL) {
+        FILE* file = fopen(path, "w");
+        if (file == NULL) {
+            fprintf(stderr, "Could not open file \"%s\".\n", path);
+        } else {
+            writeHeapProfile(file);
+            fclose(file);
+        }
+    }
+    printHeapProfileReport(stderr, 20);
+    freeHeapProfile();
+}
+#endif
+
+void yavmPrintStats(YavmVM* instance) {
+    VM* previous = enter(instance);
+#ifdef DEBUG_MEMORY_STATS
+    printMemoryStats(stderr);
+#endif
+#ifdef DEBUG_HEAP_PROFILE
+    dumpHeapProfile();
+#endif
+#ifdef DEBUG_TABLE_STATS
+    printTableStats(stderr, "vm.strings", &vm->strings);
+    printTableStats(stderr, "vm.globals", &vm->globals);
+#endif
+    leave(previous);
+}
@@ -0,0 +1,82 @@
+//
+// The embedding interface of libyavm.
+//
+// A YavmVM is an independent interpreter with its own heap, globals and modules. A process can create any number of
+// them and run each on its own thread. A VM must not be used by two threads at once, except for
+// yavmRequestCancel(). Errors in scripts are reported on stderr.
+//
+
+#ifndef YAVM_H
+#define YAVM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Compiled scripts, see yavmCompileAll()
+#define YAVM_BYTECODE_EXTENSION ".yvmc"
+
+typedef struct VM YavmVM;
+
+typedef enum {
+    YAVM_OK,
+    YAVM_COMPILE_ERROR,
+    YAVM_RUNTIME_ERROR,
+    // A file could not be read or written
+    YAVM_FILE_ERROR
+} YavmResult;
+
+// NULL when out of memory
+YavmVM* yavmNew();
+void yavmFree(YavmVM* vm);
+
+// Runs the source in the VM's global scope, after whatever ran in it before
+YavmResult yavmInterpret(YavmVM* vm, const char* source);
+// Like yavmInterpret(), but keeps the compiled source in cacheDirectory and loads it from there on later runs
+YavmResult yavmInterpretCached(YavmVM* vm, const char* source, const char* cacheDirectory);
+// Compiles all the sources, on up to threads threads or one per core when threads is 0, then runs them in order.
+// Nothing runs if any of them fails to compile.
+YavmResult yavmInterpretAll(YavmVM* vm, const char** sources, int count, int threads);
+// Compiles and runs the file at path a segment at a time, for sources too big to hold compiled
+YavmResult yavmInterpretStream(YavmVM* vm, const char* path);
+// Runs a .yvmc file written by yavmCompileAll()
+YavmResult yavmInterpretBytecode(YavmVM* vm, const char* path);
+
+// Compiles the sources like yavmInterpretAll() and writes each one's bytecode to the matching output path instead of
+// running it. Stops writing at the first source that failed to compile.
+YavmResult yavmCompileAll(YavmVM* vm, const char** sources, const char** outputs, int count, int threads);
+
+// Limits apply to the following runs, 0 means unlimited
+void yavmSetHeapLimit(YavmVM* vm, size_t bytes);
+// The budget counts bytes of bytecode executed
+void yavmSetInstructionBudget(YavmVM* vm, size_t instructions);
+// Stops the script vm is running at its next check, safe to call from another thread or a signal handler
+void yavmRequestCancel(YavmVM* vm);
+
+// Imports in the scripts the VM runs are relative to the directory of the script at path
+void yavmSetScriptPath(YavmVM* vm, const char* path);
+// Keeps compiled modules in directory, which must outlive the VM
+void yavmSetModuleCache(YavmVM* vm, const char* directory);
+// Maps the file at path and binds its contents to the global name without copying them
+bool yavmDefineMappedString(YavmVM* vm, const char* name, const char* path);
+
+// Writes an image of the VM's globals, which running source built, to path. YAVM_RUNTIME_ERROR when the globals
+// cannot be imaged, such as while one holds a module, and YAVM_FILE_ERROR when the file cannot be written.
+YavmResult yavmWriteSnapshot(YavmVM* vm, const char* path, const char* source);
+// Defines the globals of the image at path in the VM
+bool yavmLoadSnapshot(YavmVM* vm, const char* path);
+// Checks that the image at path holds the globals the VM has after running source
+bool yavmVerifySnapshot(YavmVM* vm, const char* path, const char* source);
+
+// Interns the strings of every VM created afterwards in one table shared by all threads, so equal names are one
+// object across VMs. Call it before creating the first VM.
+void yavmShareStrings();
+// Call it once every VM has been freed
+void yavmFreeSharedStrings();
+
+// Scans the source without compiling it and returns the number of tokens, for measuring the scanner
+int yavmScan(YavmVM* vm, const char* source, int* errorCount);
+
+// Prints the statistics the library was built to collect to stderr, see commons.h. Does nothing by default.
+void yavmPrintStats(YavmVM* vm);
+
+#endif //YAVM_H